@@ -0,0 +1,244 @@
+/**
+ * AVLCache.cpp
+ * A bounded LRU cache with optional time to live, indexed by AVLTrees.
+ */
+
+#include "AVLCache.h"
+
+#include <cstdio>
+
+/**
+ * Creates an empty cache.
+ * @param capacity the most entries the cache holds, at least 1
+ */
+AVLCache::AVLCache(size_t capacity) : capacity(capacity == 0 ? 1 : capacity), head(NONE), tail(NONE),
+	statistics{0, 0, 0, 0} {}
+
+/**
+ * Inserts or replaces the value of key and makes it the most recently used entry. If the cache
+ * is full, an expired entry is dropped to make room, or the least recently used entry if none has expired.
+ * @param key the key being cached
+ * @param value the value being cached
+ * @param ttl how long the entry lives, 0 for no expiry
+ * @return returns true if key was new, returns false if an existing entry was replaced.
+ */
+bool AVLCache::put(const string& key, size_t value, chrono::milliseconds ttl) {
+	Clock::time_point now = Clock::now();
+	std::optional<size_t> existing = index.get(key);
+	size_t slot;
+	if (existing.has_value()) {
+		slot = existing.value();
+		unlink(slot);
+		if (slots[slot].expires) {
+			expiries.remove(expiryKey(slots[slot], slot));
+		}
+	} else {
+		if (index.size() >= capacity && !popExpired(now).has_value()) {
+			release(tail);
+			statistics.evictions++;
+		}
+		if (freeSlots.empty()) {
+			slot = slots.size();
+			slots.emplace_back();
+		} else {
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		slots[slot].key = key;
+		index.insert(key, slot);
+	}
+	Slot& entry = slots[slot];
+	entry.value = value;
+	entry.expires = ttl.count() > 0;
+	if (entry.expires) {
+		entry.expiry = now + ttl;
+		expiries.insert(expiryKey(entry, slot), slot);
+	}
+	link(slot);
+	return !existing.has_value();
+}
+
+/**
+ * Looks up key and makes it the most recently used entry. An expired entry is dropped and counts as a miss.
+ * @param key the key being looked up
+ * @return returns the value of key, if it is cached and has not expired.
+ */
+std::optional<size_t> AVLCache::get(const string& key) {
+	std::optional<size_t> slot = index.get(key);
+	if (!slot.has_value()) {
+		statistics.misses++;
+		return nullopt;
+	}
+	if (isExpired(slots[slot.value()], Clock::now())) {
+		release(slot.value());
+		statistics.expirations++;
+		statistics.misses++;
+		return nullopt;
+	}
+	statistics.hits++;
+	unlink(slot.value());
+	link(slot.value());
+	return slots[slot.value()].value;
+}
+
+/**
+ * Checks for key without changing its recency or the statistics.
+ * @param key the key being checked
+ * @return returns true if key is cached and has not expired, false otherwise.
+ */
+bool AVLCache::contains(const string& key) const {
+	std::optional<size_t> slot = index.get(key);
+	return slot.has_value() && !isExpired(slots[slot.value()], Clock::now());
+}
+
+/**
+ * @param key the key being removed
+ * @return returns true if key was cached and removed, returns false otherwise.
+ */
+bool AVLCache::remove(const string& key) {
+	std::optional<size_t> slot = index.get(key);
+	if (!slot.has_value()) {
+		return false;
+	}
+	release(slot.value());
+	return true;
+}
+
+/**
+ * Removes the entry which expires first, if it has expired by now. Calling this until it returns
+ * nothing drops the expired entries in the order they expired.
+ * @param now the time entries are checked against
+ * @return returns the key and value of the removed entry, or nothing if no entry has expired.
+ */
+std::optional<pair<string, size_t>> AVLCache::popExpired(Clock::time_point now) {
+	std::optional<string> first = expiries.keyAt(0);
+	if (!first.has_value()) {
+		return nullopt;
+	}
+	size_t slot = expiries.get(first.value()).value();
+	if (!isExpired(slots[slot], now)) {
+		return nullopt;
+	}
+	pair<string, size_t> expired = {slots[slot].key, slots[slot].value};
+	release(slot);
+	statistics.expirations++;
+	return expired;
+}
+
+/**
+ * Removes every entry which has expired by now.
+ * @param now the time entries are checked against
+ * @return returns the number of entries removed.
+ */
+size_t AVLCache::removeExpired(Clock::time_point now) {
+	size_t removed = 0;
+	while (popExpired(now).has_value()) {
+		removed++;
+	}
+	return removed;
+}
+
+/**
+ * @return returns every cached key from the most to the least recently used.
+ */
+vector<string> AVLCache::keysByRecency() const {
+	vector<string> keys;
+	keys.reserve(index.size());
+	for (size_t slot = head; slot != NONE; slot = slots[slot].next) {
+		keys.push_back(slots[slot].key);
+	}
+	return keys;
+}
+
+/**
+ * @return returns the number of cached entries, including expired entries not dropped yet.
+ */
+size_t AVLCache::size() const {
+	return index.size();
+}
+
+/**
+ * @return returns the most entries the cache holds.
+ */
+size_t AVLCache::getCapacity() const {
+	return capacity;
+}
+
+/**
+ * @return returns the hits, misses, evictions and expirations counted so far.
+ */
+AVLCache::Statistics AVLCache::getStatistics() const {
+	return statistics;
+}
+
+/**
+ * links an unlinked slot at the front of the recency list, as the most recently used entry.
+ * @param slot the slot being linked
+ */
+void AVLCache::link(size_t slot) {
+	slots[slot].prev = NONE;
+	slots[slot].next = head;
+	if (head != NONE) {
+		slots[head].prev = slot;
+	}
+	head = slot;
+	if (tail == NONE) {
+		tail = slot;
+	}
+}
+
+/**
+ * takes a slot out of the recency list, in O(1).
+ * @param slot the slot being unlinked
+ */
+void AVLCache::unlink(size_t slot) {
+	Slot& entry = slots[slot];
+	if (entry.prev != NONE) {
+		slots[entry.prev].next = entry.next;
+	} else {
+		head = entry.next;
+	}
+	if (entry.next != NONE) {
+		slots[entry.next].prev = entry.prev;
+	} else {
+		tail = entry.prev;
+	}
+}
+
+/**
+ * removes an entry from the recency list and both indexes, and frees its slot for reuse.
+ * @param slot the slot being released
+ */
+void AVLCache::release(size_t slot) {
+	Slot& entry = slots[slot];
+	unlink(slot);
+	index.remove(entry.key);
+	if (entry.expires) {
+		expiries.remove(expiryKey(entry, slot));
+	}
+	entry.key.clear();
+	freeSlots.push_back(slot);
+}
+
+/**
+ * builds the key of an entry in the expiry index. The expiry time and slot are zero padded to a fixed
+ * width, so the keys order by expiry time, and entries expiring at the same time stay distinct.
+ * @param entry the entry, which must expire
+ * @param slot the slot holding entry
+ * @return returns the expiry key.
+ */
+string AVLCache::expiryKey(const Slot& entry, size_t slot) {
+	char buffer[48];
+	unsigned long long ticks = static_cast<unsigned long long>(entry.expiry.time_since_epoch().count());
+	snprintf(buffer, sizeof(buffer), "%020llu%020zu", ticks, slot);
+	return buffer;
+}
+
+/**
+ * @param entry the entry being checked
+ * @param now the current time
+ * @return returns true if entry expires and its expiry time is not after now.
+ */
+bool AVLCache::isExpired(const Slot& entry, Clock::time_point now) const {
+	return entry.expires && entry.expiry <= now;
+}
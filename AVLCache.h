@@ -0,0 +1,81 @@
+/**
+ * AVLCache.h
+ *
+ * A bounded map from string keys to size_t values which evicts the least recently used entry
+ * once it is full, and optionally expires entries after a time to live. An AVLTree indexes the
+ * keys, the entries are threaded onto an intrusive doubly linked recency list, and a second
+ * AVLTree orders the entries which expire by their expiry time.
+ *
+ * get and put cost O(log n) for the index lookup, after which bumping the recency of an entry
+ * is O(1). Evicting the coldest entry and popping the next expired entry cost O(log n).
+ */
+
+#ifndef AVLCACHE_H
+#define AVLCACHE_H
+#include "AVLTree.h"
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+class AVLCache {
+public:
+	using Clock = chrono::steady_clock;
+
+	// counts of what the cache did since it was created
+	struct Statistics {
+		size_t hits;
+		size_t misses;
+		size_t evictions;
+		size_t expirations;
+	};
+
+	explicit AVLCache(size_t capacity);
+
+	bool put(const string& key, size_t value, chrono::milliseconds ttl = chrono::milliseconds(0));
+	std::optional<size_t> get(const string& key);
+	bool contains(const string& key) const;
+	bool remove(const string& key);
+	std::optional<pair<string, size_t>> popExpired(Clock::time_point now = Clock::now());
+	size_t removeExpired(Clock::time_point now = Clock::now());
+	vector<string> keysByRecency() const;
+
+	size_t size() const;
+	size_t getCapacity() const;
+	Statistics getStatistics() const;
+
+private:
+	static constexpr size_t NONE = SIZE_MAX;
+
+	// an entry, linked into the recency list by slot index
+	struct Slot {
+		string key;
+		size_t value;
+		bool expires;
+		Clock::time_point expiry;
+		size_t prev; // the next more recently used slot, NONE for the most recent
+		size_t next; // the next less recently used slot, NONE for the least recent
+	};
+
+	size_t capacity;
+	AVLTree index; // key -> slot
+	AVLTree expiries; // expiry time and slot -> slot, only for entries which expire
+	vector<Slot> slots;
+	vector<size_t> freeSlots;
+	size_t head; // the most recently used slot
+	size_t tail; // the least recently used slot
+	Statistics statistics;
+
+	void link(size_t slot);
+	void unlink(size_t slot);
+	void release(size_t slot);
+	static string expiryKey(const Slot& entry, size_t slot);
+	bool isExpired(const Slot& entry, Clock::time_point now) const;
+};
+
+#endif //AVLCACHE_H
@@ -6,93 +6,321 @@
 
 #include "AVLTree.h"
 
+#include <algorithm>
+#include <cassert>
 #include <charconv>
+#include <coroutine>
+#include <exception>
+#include <future>
 #include <optional>
 #include <ios>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 
 // The default constructor of AVLTree.
-AVLTree::AVLTree() : root(nullptr) {}
+AVLTree::AVLTree() : root(nullptr), nodePool(make_shared<NodePool>()), rotations(0), version(0), lazyDeletion(false),
+	compactionRatio(0.25), writeTimestamp(1), newestReader(0), versionsStale(false) {}
+
+/**
+ * Creates an empty tree with the given key storage.
+ * @param storage how keys are stored in the nodes
+ * @param separator with PrefixCompressed, keys are split after the last occurrence of separator
+ */
+AVLTree::AVLTree(KeyStorage storage, char separator) : AVLTree() {
+	if (storage == KeyStorage::PrefixCompressed) {
+		prefixPool = make_shared<PrefixPool>();
+		prefixPool->separator = separator;
+	}
+}
 
 /**
  * Recursively destroys all key-pair values in the AVLTree and resets root.
+ * Large trees are torn down on every hardware thread.
  */
 AVLTree::~AVLTree() {
-	destroy(root);
-	root = nullptr;
+	destroyTree(size() >= PARALLEL_CUTOFF ? 0 : 1);
 }
 
 /**
- * Recursively creates a deep copy of an AVLTree.
+ * Recursively creates a deep copy of an AVLTree. The copy has the same shape as other,
+ * so no rebalancing is needed, and large trees are copied on every hardware thread.
  *
  * @param other the AVLTree being copied
  */
-AVLTree::AVLTree(const AVLTree& other) : root(nullptr) {
-	createDeepCopy(other.getRoot());
+AVLTree::AVLTree(const AVLTree& other) : root(nullptr), nodePool(make_shared<NodePool>()), rotations(0), version(0),
+	lazyDeletion(other.lazyDeletion), compactionRatio(other.compactionRatio), writeTimestamp(other.writeTimestamp), newestReader(0), versionsStale(false) {
+	if (other.prefixPool != nullptr) {
+		prefixPool = make_shared<PrefixPool>();
+		prefixPool->separator = other.prefixPool->separator;
+	}
+	AVLNode* otherRoot = other.getRoot();
+	AVLNode* slots = otherRoot != nullptr ? reserveNodes(otherRoot->count + otherRoot->tombstones) : nullptr;
+	// the cached hashes are copied too, a diff of other must not refresh them meanwhile
+	lock_guard guard(other.hashLock);
+	root = createDeepCopy(otherRoot, other.size() >= PARALLEL_CUTOFF ? getThreadCount(0) : 1, slots);
 }
 
 
-size_t& AVLTree::operator[](const std::string& key) {
-	AVLNode* node = getNodeRef(key, root);
-	if (node != nullptr) {
-		return node->value;
+/**
+ * Finds the value of key, inserting key with the value 0 first if it is not in the tree, like std::map.
+ * Writes through the returned reference are made to the tree as they happen, see ValueReference.
+ * @param key the key being looked up
+ * @return returns a reference to the value of key, valid as long as the tree.
+ */
+AVLTree::ValueReference AVLTree::operator[](const std::string& key) {
+	if (!contains(key)) {
+		insert(key, 0);
+	}
+	return ValueReference(*this, key);
+}
+
+/**
+ * Finds the value of key without inserting it.
+ * Writes through the returned reference are made to the tree as they happen, see ValueReference.
+ * @param key the key being looked up
+ * @return returns a reference to the value of key, valid as long as the tree.
+ * @throws std::out_of_range if key is not in the tree.
+ */
+AVLTree::ValueReference AVLTree::at(const std::string& key) {
+	if (!contains(key)) {
+		throw std::out_of_range("AVLTree::at: key not in tree");
 	}
-	size_t zero = 0;
-	return zero;
+	return ValueReference(*this, key);
 }
 
 /**
- *
- * @param other
+ * Finds the value of key without inserting it.
+ * @param key the key being looked up
+ * @return returns a reference to the value of key.
+ * @throws std::out_of_range if key is not in the tree.
+ */
+const size_t& AVLTree::at(const std::string& key) const {
+	const AVLNode* node = getNodeRef(key, root);
+	if (node == nullptr) {
+		throw std::out_of_range("AVLTree::at: key not in tree");
+	}
+	return node->value;
+}
+
+/**
+ * Creates a reference to the value of key.
+ * @param tree the tree holding key
+ * @param key the key referred to
+ */
+AVLTree::ValueReference::ValueReference(AVLTree& tree, const KeyType& key) : tree(&tree), key(key) {}
+
+/**
+ * @return returns the value of the key in the tree, 0 if it was removed.
+ */
+AVLTree::ValueReference::operator ValueType() const {
+	return tree->get(key).value_or(0);
+}
+
+/**
+ * Writes value to the tree, inserting the key again if it was removed.
+ * @param value the new value
+ * @return returns this reference.
+ */
+AVLTree::ValueReference& AVLTree::ValueReference::operator=(ValueType value) {
+	tree->update(key, value, false);
+	return *this;
+}
+
+/**
+ * Writes the value other refers to, like assigning through a size_t&. This reference keeps its key.
+ * @param other the reference whose value is written
+ * @return returns this reference.
+ */
+AVLTree::ValueReference& AVLTree::ValueReference::operator=(const ValueReference& other) {
+	return *this = static_cast<ValueType>(other);
+}
+
+/**
+ * Adds delta to the value in the tree, in a single descent like increment.
+ * @param delta the amount added
+ * @return returns this reference.
+ */
+AVLTree::ValueReference& AVLTree::ValueReference::operator+=(ValueType delta) {
+	tree->update(key, delta, true);
+	return *this;
+}
+
+/**
+ * Subtracts delta from the value in the tree, wrapping around like size_t.
+ * @param delta the amount subtracted
+ * @return returns this reference.
+ */
+AVLTree::ValueReference& AVLTree::ValueReference::operator-=(ValueType delta) {
+	// adding the two's complement subtracts
+	tree->update(key, ValueType(0) - delta, true);
+	return *this;
+}
+
+/**
+ * Adds 1 to the value in the tree.
+ * @return returns this reference.
+ */
+AVLTree::ValueReference& AVLTree::ValueReference::operator++() {
+	return *this += 1;
+}
+
+/**
+ * Subtracts 1 from the value in the tree.
+ * @return returns this reference.
+ */
+AVLTree::ValueReference& AVLTree::ValueReference::operator--() {
+	return *this -= 1;
+}
+
+/**
+ * Adds 1 to the value in the tree.
+ * @return returns the value before.
+ */
+AVLTree::ValueType AVLTree::ValueReference::operator++(int) {
+	return tree->update(key, 1, true) - 1;
+}
+
+/**
+ * Subtracts 1 from the value in the tree.
+ * @return returns the value before.
+ */
+AVLTree::ValueType AVLTree::ValueReference::operator--(int) {
+	return tree->update(key, ValueType(0) - 1, true) + 1;
+}
+
+/**
+ * Replaces the contents of this tree with a deep copy of other, see the copy constructor. The key
+ * storage and lazy deletion settings are copied too, and the listeners of this tree are kept and told
+ * about the removal of every old entry and the insert of every new one.
+ * @param other the AVLTree being copied
+ * @return returns this tree.
+ * @throws std::logic_error if a read of this tree started by beginRead has not ended, see clear.
  */
-void AVLTree::operator=(const AVLTree& other) {
+AVLTree& AVLTree::operator=(const AVLTree& other) {
+	if (&other == this) {
+		return *this;
+	}
+	clear(size() >= PARALLEL_CUTOFF ? 0 : 1);
+	prefixPool = nullptr;
+	if (other.prefixPool != nullptr) {
+		prefixPool = make_shared<PrefixPool>();
+		prefixPool->separator = other.prefixPool->separator;
+	}
+	lazyDeletion = other.lazyDeletion;
+	compactionRatio = other.compactionRatio;
+	writeTimestamp = max(writeTimestamp, other.writeTimestamp);
+	AVLNode* otherRoot = other.getRoot();
+	AVLNode* slots = otherRoot != nullptr ? reserveNodes(otherRoot->count + otherRoot->tombstones) : nullptr;
+	// the cached hashes are copied too, a diff of other must not refresh them meanwhile
+	lock_guard guard(other.hashLock);
+	root = createDeepCopy(otherRoot, other.size() >= PARALLEL_CUTOFF ? getThreadCount(0) : 1, slots);
+	version++;
+	reportBulk(root, true);
+#ifdef AVLTREE_VALIDATE
+	assert(validate());
+#endif
+	return *this;
 }
 
 /**
  * Insert a new key-value pair into the tree. After a successful insert, the tree is rebalanced if necessary.
- * Duplicate keys and values are disallowed
+ * Duplicate keys are disallowed
  *
  * @param key the key being inserted
  * @param value the value being inserted
  * @return returns true if the insertion is successful, returns false otherwise.
  */
 bool AVLTree::insert(const std::string& key, size_t value) {
-	// check for duplicate keys
-	if (contains(key)) {
-		return false;
-	}
+	beginWrite();
 	std::string nonConstKey = key;
 
-	// try to insert key-value pair. Will fail if the value is already in the AVLTree.
-	if (insertNode(nonConstKey, value, root)) {
-		return true;
+	// try to insert key-value pair. Will fail if the key is already in the AVLTree.
+	bool inserted = insertNode(nonConstKey, value, root);
+	if (inserted) {
+		version++;
+		for (Listener* listener : listeners) {
+			listener->onInsert(key, value);
+		}
 	}
-	return false;
+#ifdef AVLTREE_VALIDATE
+	assert(validate());
+#endif
+	return inserted;
 }
 
 /**
  * If the key is in the tree, remove() will delete the key-value pair from the tree. The memory allocated
  * for the node that is removed will be released. After removing the key-value pair, the tree is
- * rebalanced if necessary.
+ * rebalanced if necessary. With lazy deletion on, or while there are readers (see beginRead), the node is only
+ * marked as a tombstone, see setLazyDeletion.
  *
  * @param key the key being removed from the AVLTree
  * @return returns true if the key was found and removed, returns false otherwise.
  */
 bool AVLTree::remove(const std::string& key) {
-	// variables //
-	std::string nonConstKey = key;
-	std::optional<size_t> value = get(key);
+	beginWrite();
+	// readers at an older timestamp may still see the node, so it stays as a tombstone until they end
+	bool removed = lazyDeletion || hasReaders() ? markDeleted(root, key) : remove(root, key);
+	if (removed) {
+		version++;
+		for (Listener* listener : listeners) {
+			listener->onRemove(key);
+		}
+		// compact a few tombstones at a time once they take up too much of the tree
+		if (lazyDeletion && !hasReaders() && root->tombstones > compactionRatio * (root->count + root->tombstones)) {
+			purgeTombstones(PURGE_STEP);
+		}
+	}
+#ifdef AVLTREE_VALIDATE
+	assert(validate());
+#endif
+	return removed;
+}
 
-	// if a value associated with the key can be found, try to remove.
-	if (value.has_value()) {
-		return (remove(root, nonConstKey, value.value()));
+/**
+ * Adds delta to the value of key in a single O(log n) descent, inserting key with the value delta
+ * if it is not in the tree. Listeners are told about an insert or an update.
+ * @param key the key being counted
+ * @param delta the amount added to the value
+ * @return returns the new value of key.
+ */
+AVLTree::ValueType AVLTree::increment(const string& key, ValueType delta) {
+	return update(key, delta, true);
+}
+
+/**
+ * sets the value of key, or adds to it, in a single O(log n) descent, inserting key with the value 0
+ * first if it is not in the tree. Listeners are told about an insert or an update.
+ * @param key the key being written
+ * @param value the new value, or the amount added to the value if relative
+ * @param relative whether value is added to the value instead of replacing it
+ * @return returns the new value of key.
+ */
+AVLTree::ValueType AVLTree::update(const KeyType& key, ValueType value, bool relative) {
+	beginWrite();
+	AVLNode* node = nullptr;
+	bool inserted = findOrInsert(key, root, node);
+	node->value = relative ? node->value + value : value;
+	if (inserted) {
+		version++;
 	}
-	return false;
+	for (Listener* listener : listeners) {
+		if (inserted) {
+			listener->onInsert(key, node->value);
+		} else {
+			listener->onUpdate(key, node->value);
+		}
+	}
+#ifdef AVLTREE_VALIDATE
+	assert(validate());
+#endif
+	return node->value;
 }
 
 /**
- * Recursively checks if the given key is in the AVLTree.
+ * Recursively checks if the given key is in the AVLTree. O(log n).
  * @param key the key being checked
  * @return returns true if the key is in the AVLTree and false otherwise.
  */
@@ -101,7 +329,7 @@ bool AVLTree::contains(const string& key) const {
 }
 
 /**
- * recursive helper method of contains. Traverses the entire tree to search for the given key.
+ * recursive helper method of contains. Descends the single path the given key can be on.
  * @param current the current node being checked
  * @param key the key being searched for
  * @return returns true if the key is in the AVLTree and false otherwise.
@@ -111,22 +339,19 @@ bool AVLTree::containsRecursive(AVLNode* current, const string& key) const {
 	if (current == nullptr) {
 		return false;
 	}
-	// visit current
-	if (current->getKey() == key) {
-		return true;
-	}
-	// recurse left, then right
-	if (containsRecursive(current->left, key)) {
-		return true;
+	// visit current, then recurse into the subtree which can hold key
+	int comparison = compareKey(key, current);
+	if (comparison == 0) {
+		return !current->deleted;
 	}
-	if (containsRecursive(current->right, key)) {
-		return true;
+	if (comparison < 0) {
+		return containsRecursive(current->left, key);
 	}
-	return false;
+	return containsRecursive(current->right, key);
 }
 
 /**
- * Recursively searches for the value associated with the given key.
+ * Recursively searches for the value associated with the given key. O(log n).
  * @param key the key associated with the return value.
  * @return returns the value associated with the key, if it is in the tree, otherwise returns null.
  */
@@ -134,6 +359,105 @@ std::optional<size_t> AVLTree::get(const string& key) const {
 	return get(key, root);
 }
 
+/**
+ * A coroutine running one lookup group of getBatch. It starts suspended, and the scheduler in getBatch
+ * resumes it until it is done.
+ */
+struct AVLTree::LookupTask {
+	struct promise_type {
+		LookupTask get_return_object() {
+			return LookupTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	explicit LookupTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	LookupTask(LookupTask&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	LookupTask(const LookupTask&) = delete;
+	~LookupTask() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * asks the cache to start loading a node, so it is there by the time the lookup visiting it is resumed.
+ * @param node the node about to be visited
+ */
+static inline void prefetchNode(const void* node) {
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(node);
+#endif
+}
+
+/**
+ * Looks up many keys at once, hiding the cache miss of every step down the tree. The keys are split
+ * between group coroutines (group prefetching): after choosing a child, a lookup prefetches it and
+ * suspends, and the other lookups run while the child is loaded. For trees which do not fit in the
+ * cache this gives several times the throughput of calling get for each key, for trees which do, it
+ * is about the same.
+ * @param keys the keys being looked up
+ * @param group the number of lookups in flight at once, 8 to 32 works best
+ * @return returns the value of every key, in the order of keys, nothing for keys not in the tree.
+ */
+vector<std::optional<AVLTree::ValueType>> AVLTree::getBatch(const vector<KeyType>& keys, size_t group) const {
+	vector<std::optional<ValueType>> results(keys.size());
+	size_t next = 0;
+	vector<LookupTask> tasks;
+	group = std::max<size_t>(1, std::min(group, keys.size()));
+	tasks.reserve(group);
+	for (size_t i = 0; i < group; i++) {
+		tasks.push_back(lookupGroup(keys, results, next));
+	}
+	// resume every unfinished lookup in turn until they are all done
+	size_t running = tasks.size();
+	while (running > 0) {
+		for (LookupTask& task : tasks) {
+			if (!task.handle.done()) {
+				task.handle.resume();
+				if (task.handle.done()) {
+					running--;
+				}
+			}
+		}
+	}
+	return results;
+}
+
+/**
+ * coroutine helper method of getBatch. Takes the next key which no lookup has started yet, until none are
+ * left, and descends to it, suspending after prefetching each node it is about to visit.
+ * @param keys the keys being looked up
+ * @param results where the value of keys[i] is written
+ * @param next the index of the next key no lookup has started, shared by every lookup of the batch
+ */
+AVLTree::LookupTask AVLTree::lookupGroup(const vector<KeyType>& keys, vector<std::optional<ValueType>>& results, size_t& next) const {
+	while (next < keys.size()) {
+		size_t i = next++;
+		AVLNode* current = root;
+		while (current != nullptr) {
+			int comparison = compareKey(keys[i], current);
+			if (comparison == 0) {
+				if (!current->deleted) {
+					results[i] = current->value;
+				}
+				break;
+			}
+			current = comparison < 0 ? current->left : current->right;
+			if (current != nullptr) {
+				prefetchNode(current);
+				co_await std::suspend_always{};
+			}
+		}
+	}
+}
+
 /**
  * returns a vector of all values in the AVLTree which are higher than lowKeys value and lower than highKeys value
  * @param lowKey the key associated with a lower value
@@ -142,35 +466,21 @@ std::optional<size_t> AVLTree::get(const string& key) const {
  */
 vector<size_t> AVLTree::findRange(const std::string& lowKey, const std::string& highKey) const {
 	vector<size_t> range;
-	std::optional<size_t> lowVal = get(lowKey);
-	std::optional<size_t> highVal = get(highKey);
-	if (lowVal.has_value() && highVal.has_value()) {
-		range = findRange(range, lowVal.value(), highVal.value(), root);
-	}
+	findRange(lowKey, highKey, back_inserter(range));
 	return range;
 }
 
 /**
- * Recursive helper method of findRange which checks for values belonging in the vector via inorder traversal.
- * @param range the vector storing the values
- * @param lowVal the lower value
- * @param highVal the higher value
- * @param current the current node being checked
- * @return returns the range vector with values.
+ * fills a caller's buffer with every value between the values of lowKey and highKey, like
+ * findRange(lowKey, highKey). Reusing one buffer across calls keeps its capacity, so repeated
+ * calls stop allocating once it has grown to the largest result.
+ * @param lowKey the key associated with a lower value
+ * @param highKey the key associated with a higher value
+ * @param buffer the vector replaced by the values
  */
-vector<size_t> AVLTree::findRange(vector<size_t> range, size_t lowVal, size_t highVal, AVLNode* current) const {
-	if (current == nullptr) {
-		return range;
-	}
-	range = findRange(range, lowVal, highVal, current->left); // recurse left
-
-	// if current value is between highval and lowval, add to vector
-	if (current->value >= lowVal && current->value <= highVal) {
-		range.push_back(current->value);
-	}
-	range = findRange(range, lowVal, highVal, current->right); // recurse right
-
-	return range;
+void AVLTree::findRange(const string& lowKey, const string& highKey, vector<ValueType>& buffer) const {
+	buffer.clear();
+	findRange(lowKey, highKey, back_inserter(buffer));
 }
 
 /**
@@ -179,180 +489,1317 @@ vector<size_t> AVLTree::findRange(vector<size_t> range, size_t lowVal, size_t hi
  */
 vector<std::string> AVLTree::keys() const {
 	vector<string> keys;
-	keys = getAllKeys(root, keys);
+	keys.reserve(size());
+	getAllKeys(root, keys);
+	return keys;
+}
+
+/**
+ * fills a caller's buffer with every key in key order, like keys(). The strings already in buffer
+ * are overwritten in place, so a buffer reused across calls keeps both its capacity and the
+ * capacity of each string, and stops allocating once it has grown to fit the tree.
+ * @param buffer the vector replaced by the keys
+ */
+void AVLTree::keys(vector<KeyType>& buffer) const {
+	buffer.resize(size());
+	size_t next = 0;
+	forEach([&buffer, &next](const KeyType& key, ValueType) {
+		buffer[next++] = key;
+	});
+}
+
+/**
+ * forms a list of all keys in the AVLTree on up to threads threads. Every subtree knows its count,
+ * so each thread writes its subtree's keys straight into its own slice of the result.
+ * @param threads the most threads used, 0 for one per hardware thread
+ * @return returns a vector of all keys in the AVLTree.
+ */
+vector<std::string> AVLTree::keys(size_t threads) const {
+	vector<string> keys(size());
+	fillKeys(root, keys.data(), getThreadCount(threads));
 	return keys;
 }
 
+/**
+ * recursive helper method of keys(threads). Writes the keys of a subtree in order starting at keys.
+ * While more than one thread is left, the left subtree is filled on a new thread.
+ * @param current the root of the subtree
+ * @param keys where the first key of the subtree is written
+ * @param threads the threads left for this subtree
+ */
+void AVLTree::fillKeys(AVLNode* current, string* keys, size_t threads) const {
+	if (current == nullptr) {
+		return;
+	}
+	size_t leftCount = current->left != nullptr ? current->left->count : 0;
+	size_t rightStart = leftCount;
+	if (!current->deleted) {
+		keys[rightStart++] = current->getKey();
+	}
+	if (threads > 1 && current->count >= PARALLEL_CUTOFF) {
+		auto left = async(launch::async, [this, current, keys, threads]() {
+			fillKeys(current->left, keys, threads / 2);
+		});
+		fillKeys(current->right, keys + rightStart, threads - threads / 2);
+		left.get();
+	} else {
+		fillKeys(current->left, keys, 1);
+		fillKeys(current->right, keys + rightStart, 1);
+	}
+}
+
 /**
  * recursive helper method of keys. Contains all of the actual logic for keys.
  * @param current the current node being checked.
  * @param keys the vector containing the AVLTree keys.
- * @return returns keys
  */
-vector<std::string> AVLTree::getAllKeys(AVLNode* current, vector<string>& keys) const {
+void AVLTree::getAllKeys(AVLNode* current, vector<string>& keys) const {
 	// BASE CASE: nullptr, no more nodes on this branch.
 	if (current == nullptr) {
-		return keys;
+		return;
 	}
 	// recurse left
 	getAllKeys(current->left, keys);
 
-	// get current key
-	keys.push_back(current->getKey());
+	// get current key, unless it was removed
+	if (!current->deleted) {
+		keys.push_back(current->getKey());
+	}
 
 	// recurse right
 	getAllKeys(current->right, keys);
-
-	return keys;
 }
 
 /**
- * finds the size of the AVLTree by checking how many keys are in the tree.
- * @return returns the number of key-pair values in the tree.
+ * forms a list of every key-value pair in the AVLTree, in key order.
+ * @return returns a vector of all key-value pairs in the AVLTree.
  */
-size_t AVLTree::size() const {
-	return keys().size();
+vector<pair<AVLTree::KeyType, AVLTree::ValueType>> AVLTree::entries() const {
+	vector<pair<KeyType, ValueType>> entries;
+	entries.reserve(size());
+	getAllEntries(root, entries);
+	return entries;
 }
+
 /**
- * Checks the height of the AVLTree by checking the left and right subtrees of root
- * recursively and returning the higher value
- * @return returns the height of the AVLTree
+ * forms a list of every key-value pair in the AVLTree on up to threads threads, see keys(threads).
+ * @param threads the most threads used, 0 for one per hardware thread
+ * @return returns a vector of all key-value pairs in the AVLTree.
  */
-size_t AVLTree::getHeight() const {
-	return height(root);
+vector<pair<AVLTree::KeyType, AVLTree::ValueType>> AVLTree::entries(size_t threads) const {
+	vector<pair<KeyType, ValueType>> entries(size());
+	fillEntries(root, entries.data(), getThreadCount(threads));
+	return entries;
 }
 
 /**
- * converts the AVLTree into an ostream.
- * @param os ostream reference
- * @param AVLTree the AVLTree being printed
- * @return returns os
+ * recursive helper method of entries(threads). Writes the pairs of a subtree in order starting at entries.
+ * @param current the root of the subtree
+ * @param entries where the first pair of the subtree is written
+ * @param threads the threads left for this subtree
  */
-std::ostream& operator<<(ostream& os, const AVLTree& AVLTree) {
-	AVLTree.printTree(os, AVLTree.root, 0);
-	return os;
+void AVLTree::fillEntries(AVLNode* current, pair<KeyType, ValueType>* entries, size_t threads) const {
+	if (current == nullptr) {
+		return;
+	}
+	size_t leftCount = current->left != nullptr ? current->left->count : 0;
+	size_t rightStart = leftCount;
+	if (!current->deleted) {
+		entries[rightStart++] = {current->getKey(), current->value};
+	}
+	if (threads > 1 && current->count >= PARALLEL_CUTOFF) {
+		auto left = async(launch::async, [this, current, entries, threads]() {
+			fillEntries(current->left, entries, threads / 2);
+		});
+		fillEntries(current->right, entries + rightStart, threads - threads / 2);
+		left.get();
+	} else {
+		fillEntries(current->left, entries, 1);
+		fillEntries(current->right, entries + rightStart, 1);
+	}
 }
 
 /**
- * recursive helper method of operator<<
- *
- * prints right to left while using indents to represent depth.
- * @param os ostream reference
- * @param current the current node being printed
- * @param depth the depth of the current node
+ * recursive helper method of entries. Uses inorder traversal.
+ * @param current the current node being checked.
+ * @param entries the vector the key-value pairs are added to.
  */
-void AVLTree::printTree(ostream& os, AVLNode* current, size_t depth) const {
-	// BASE CASE: no more to print down this subtree if current == nullptr.
+void AVLTree::getAllEntries(AVLNode* current, vector<pair<KeyType, ValueType>>& entries) const {
+	// BASE CASE: nullptr, no more nodes on this branch.
 	if (current == nullptr) {
 		return;
 	}
-	// recurse down right subtree
-	printTree(os, current->right, depth + 1);
-
-	// print current
-	for (int i = 0; i < depth; i++) {
-		os << "    ";
+	getAllEntries(current->left, entries);
+	if (!current->deleted) {
+		entries.emplace_back(current->getKey(), current->value);
 	}
-	os << "{" << current->getKey() << ": " << current->getValue() << "}" << std::endl;
-
-	// recurse down left subtree
-	printTree(os, current->left, depth + 1);
+	getAllEntries(current->right, entries);
 }
 
-/*
-=================
-= AVLNode Class =
-= ------------- =================================================
-= The AVLNode class defines the nodes which make up an AVLTree. =
-================================================================= */
 /**
- * the default(empty) constructor of AVLNode
+ * Finds every key-value pair whose key is in [lowKey, highKey), in key order. Unlike findRange this
+ * compares keys, so only the subtrees which can hold such keys are visited, in O(log n + k).
+ * @param lowKey the first key included
+ * @param highKey the first key not included
+ * @return returns a vector of the key-value pairs in the range.
  */
-AVLTree::AVLNode::AVLNode() {
-	this->key = "";
-	this->value = 0;
-	this->left = nullptr;
-	this->right = nullptr;
-	height = 0;
+vector<pair<AVLTree::KeyType, AVLTree::ValueType>> AVLTree::scanRange(const string& lowKey, const string& highKey) const {
+	vector<pair<KeyType, ValueType>> entries;
+	scanRange(root, lowKey, &highKey, entries);
+	return entries;
 }
 
 /**
- * constructor with starting values for value and key
- * @param key the key being loaded
- * @param value the value being loaded
+ * Finds every key-value pair whose key starts with prefix, in key order, in O(log n + k).
+ * @param prefix the prefix of every key returned
+ * @return returns a vector of the key-value pairs whose keys start with prefix.
  */
-AVLTree::AVLNode::AVLNode(std::string &key, size_t value) {
-	this->key = key;
-	this->value = value;
-	this->left = nullptr;
-	this->right = nullptr;
-	height = 0;
+vector<pair<AVLTree::KeyType, AVLTree::ValueType>> AVLTree::scanPrefix(const string& prefix) const {
+	// the keys with prefix are the keys from prefix up to the next string which doesn't start with it
+	string highKey = prefix;
+	while (!highKey.empty() && static_cast<unsigned char>(highKey.back()) == 0xff) {
+		highKey.pop_back();
+	}
+	vector<pair<KeyType, ValueType>> entries;
+	if (highKey.empty()) {
+		scanRange(root, prefix, nullptr, entries);
+	} else {
+		highKey.back() = static_cast<char>(static_cast<unsigned char>(highKey.back()) + 1);
+		scanRange(root, prefix, &highKey, entries);
+	}
+	return entries;
 }
 
 /**
- * sets the key and value of the node
- * @param key the key being loaded
- * @param value the value being loaded
+ * recursive helper method of scanRange and scanPrefix. Uses inorder traversal, skipping every
+ * subtree which is entirely outside the range.
+ * @param current the current node being checked
+ * @param lowKey the first key included
+ * @param highKey the first key not included, nullptr if there is no upper bound
+ * @param entries the vector the key-value pairs in range are added to
  */
-void AVLTree::AVLNode::load(std::string &key, size_t value) {
-	this->key = key;
-	this->value = value;
+void AVLTree::scanRange(AVLNode* current, const string& lowKey, const string* highKey, vector<pair<KeyType, ValueType>>& entries) const {
+	if (current == nullptr) {
+		return;
+	}
+	bool aboveLow = compareKey(lowKey, current) <= 0;
+	bool belowHigh = highKey == nullptr || compareKey(*highKey, current) > 0;
+	if (aboveLow) {
+		scanRange(current->left, lowKey, highKey, entries);
+	}
+	if (aboveLow && belowHigh && !current->deleted) {
+		entries.emplace_back(current->getKey(), current->value);
+	}
+	if (belowHigh) {
+		scanRange(current->right, lowKey, highKey, entries);
+	}
 }
 
 /**
- * sets the right reference to rightChild
- * @param rightChild the new rightChild of this node
+ * recursive helper method of forEach and forEachInRange. Uses inorder traversal like scanRange, calling
+ * visit with the key stored in each node instead of a copy. The key of a prefix compressed node is
+ * assembled in scratch, which keeps its capacity from key to key.
+ * @param current the current node being checked
+ * @param lowKey the first key included, nullptr if there is no lower bound
+ * @param highKey the first key not included, nullptr if there is no upper bound
+ * @param timestamp the pairs are visited as they were at this timestamp, UINT64_MAX for the current pairs
+ * @param visit the function called with each key-value pair in range
+ * @param context passed to visit
+ * @param scratch the buffer prefix compressed keys are assembled in
  */
-void AVLTree::AVLNode::insertRight(AVLNode* rightChild) {
-	this->right = rightChild;
+void AVLTree::visitRange(AVLNode* current, const KeyType* lowKey, const KeyType* highKey, uint64_t timestamp, Visit visit, void* context, KeyType& scratch) const {
+	while (current != nullptr) {
+		bool aboveLow = lowKey == nullptr || compareKey(*lowKey, current) <= 0;
+		bool belowHigh = highKey == nullptr || compareKey(*highKey, current) > 0;
+		if (aboveLow) {
+			visitRange(current->left, lowKey, highKey, timestamp, visit, context, scratch);
+		}
+		std::optional<ValueType> value = aboveLow && belowHigh ? valueAt(current, timestamp) : nullopt;
+		if (value.has_value()) {
+			if (current->prefix != nullptr) {
+				scratch.assign(*current->prefix).append(current->key);
+				visit(context, scratch, value.value());
+			} else {
+				visit(context, current->key, value.value());
+			}
+		}
+		// the right subtree is visited by the loop instead of a call
+		current = belowHigh ? current->right : nullptr;
+	}
 }
 
 /**
- * sets the left reference to leftChild
- * @param leftChild the new leftChild of this node
+ * @return returns how the keys of this tree are stored.
  */
-void AVLTree::AVLNode::insertLeft(AVLNode* leftChild) {
-	this->left = leftChild;
+AVLTree::KeyStorage AVLTree::getKeyStorage() const {
+	return prefixPool != nullptr ? KeyStorage::PrefixCompressed : KeyStorage::Full;
 }
 
 /**
- * sets the height of the node
- * @param height the new height
+ * finds the key at a position in key order using the subtree counts, in O(log n).
+ * @param index the position of the key, starting from 0
+ * @return returns the key at index, or nothing if index is not less than size().
  */
-void AVLTree::AVLNode::setHeight(int height) {
-	this->height = height;
+std::optional<AVLTree::KeyType> AVLTree::keyAt(size_t index) const {
+	AVLNode* current = root;
+	while (current != nullptr) {
+		size_t leftCount = current->left != nullptr ? current->left->count : 0;
+		if (index == leftCount && !current->deleted) {
+			return current->getKey();
+		}
+		if (index < leftCount) {
+			current = current->left;
+		} else {
+			index -= leftCount + (current->deleted ? 0 : 1);
+			current = current->right;
+		}
+	}
+	return nullopt;
 }
 
-// ACCESSORS //
 /**
- * accessor for the key variable.
- * @return returns the key of the node
+ * finds the entry with the largest key which is not greater than key, in O(log n).
+ * @param key the key being searched for
+ * @return returns the key-value pair found, or nothing if every key is greater than key.
  */
-std::string AVLTree::AVLNode::getKey() {
-	return this->key;
+std::optional<pair<AVLTree::KeyType, AVLTree::ValueType>> AVLTree::floorEntry(const string& key) const {
+	AVLNode* node = floorNode(root, key);
+	if (node == nullptr) {
+		return nullopt;
+	}
+	return pair<KeyType, ValueType>(node->getKey(), node->value);
 }
 
 /**
- * accessor for value
- * @return returns the value of the AVLNode
+ * finds the size of the AVLTree by reading the subtree count cached in root. Tombstones are not counted.
+ * @return returns the number of key-pair values in the tree.
  */
-size_t AVLTree::AVLNode::getValue() {
-	return this->value;
+size_t AVLTree::size() const {
+	if (root == nullptr) {
+		return 0;
+	}
+	return root->count;
 }
 
 /**
- * accessor for height
- * @return returns the height of the AVLNode
+ * Checks the height of the AVLTree by reading the height cached in root. The cached
+ * heights are kept up to date by updateHeight, so this is O(1).
+ * @return returns the height of the AVLTree
  */
-size_t AVLTree::AVLNode::getHeight() {
-	return this->height;
+size_t AVLTree::getHeight() const {
+	if (root == nullptr) {
+		return 0;
+	}
+	return root->height;
 }
 
 /**
- * alternate accessor for value which returns a reference
- * @return returns a reference to value
+ * @return returns the number of single rotations performed since the tree was created.
+ * A double rotation counts as two.
  */
-size_t &AVLTree::AVLNode::getValueRef() {
+size_t AVLTree::getRotationCount() const {
+	return rotations;
+}
+
+/**
+ * Builds a perfectly balanced tree from key-value pairs sorted by key, in O(n) instead of
+ * O(n log n) for inserting them one at a time. The two halves of every large subtree are built
+ * on different threads.
+ * @param entries the pairs being loaded, in strictly increasing key order
+ * @param threads the most threads used, 0 for one per hardware thread
+ * @return returns true if the pairs were loaded, returns false if the tree was not empty, a read
+ * started by beginRead has not ended, or the keys were not strictly increasing.
+ */
+bool AVLTree::load(const vector<pair<KeyType, ValueType>>& entries, size_t threads) {
+	if (size() != 0 || hasReaders()) {
+		return false;
+	}
+	for (size_t i = 1; i < entries.size(); i++) {
+		if (entries[i - 1].first.compare(entries[i].first) >= 0) {
+			return false;
+		}
+	}
+	// drop any tombstones left in the empty tree
+	clear(1);
+	root = buildFromEntries(entries, 0, entries.size(), getThreadCount(threads), reserveNodes(entries.size()));
+	version++;
+	reportBulk(root, true);
+#ifdef AVLTREE_VALIDATE
+	assert(validate());
+#endif
+	return true;
+}
+
+/**
+ * Destroys every node in the tree, splitting the work between up to threads threads. If no other tree
+ * shares this tree's node pools, the pools are released whole instead of taking the nodes back one by one.
+ * Listeners are told about the removal of every entry.
+ * @param threads the most threads used, 0 for one per hardware thread
+ * @throws std::logic_error if a read started by beginRead has not ended, since the versions it reads
+ * would be destroyed too.
+ */
+void AVLTree::clear(size_t threads) {
+	if (hasReaders()) {
+		throw std::logic_error("AVLTree::clear: a read started by beginRead has not ended");
+	}
+	reportBulk(root, false);
+	destroyTree(threads);
+}
+
+/**
+ * destroys every node in the tree and every version, see clear.
+ * @param threads the most threads used, 0 for one per hardware thread
+ */
+void AVLTree::destroyTree(size_t threads) {
+	dropVersions();
+	if (sharesPools()) {
+		vector<AVLNode*> freed;
+		destroy(root, getThreadCount(threads), &freed);
+		releaseNodes(freed);
+	} else {
+		destroy(root, getThreadCount(threads), nullptr);
+		nodePool = make_shared<NodePool>();
+		retainedPools.clear();
+	}
+	root = nullptr;
+	version++;
+}
+
+/**
+ * @param threads the number of threads asked for, 0 for one per hardware thread
+ * @return returns the number of threads to use, at least 1.
+ */
+size_t AVLTree::getThreadCount(size_t threads) {
+	if (threads == 0) {
+		threads = thread::hardware_concurrency();
+	}
+	return threads == 0 ? 1 : threads;
+}
+
+/**
+ * Recursive helper method of load. Builds entries[low, high) into a perfectly balanced subtree,
+ * building the left half on a new thread while more than one thread is left. The nodes are placed
+ * in slots in pre-order, the order they are built in, so the threads never share an allocator.
+ * @param entries the pairs being loaded
+ * @param low the first pair of the subtree
+ * @param high one past the last pair of the subtree
+ * @param threads the threads left for this subtree
+ * @param slots memory for the nodes of the subtree, see reserveNodes
+ * @return returns the root of the subtree, nullptr if it is empty.
+ */
+AVLTree::AVLNode* AVLTree::buildFromEntries(const vector<pair<KeyType, ValueType>>& entries, size_t low, size_t high, size_t threads, AVLNode* slots) {
+	// BASE CASE: empty subtree
+	if (low >= high) {
+		return nullptr;
+	}
+	size_t middle = low + (high - low) / 2;
+	AVLNode* current = createNode(entries[middle].first, entries[middle].second, slots);
+	AVLNode* rightSlots = slots + 1 + (middle - low);
+	if (threads > 1 && high - low >= PARALLEL_CUTOFF) {
+		auto left = async(launch::async, [this, &entries, low, middle, threads, slots]() {
+			return buildFromEntries(entries, low, middle, threads / 2, slots + 1);
+		});
+		current->right = buildFromEntries(entries, middle + 1, high, threads - threads / 2, rightSlots);
+		current->left = left.get();
+	} else {
+		current->left = buildFromEntries(entries, low, middle, 1, slots + 1);
+		current->right = buildFromEntries(entries, middle + 1, high, 1, rightSlots);
+	}
+	updateHeight(current);
+#ifdef AVLTREE_RANK_BALANCED
+	current->rank = static_cast<int>(current->height);
+#endif
+	return current;
+}
+
+/**
+ * Moves every key-value pair whose key is not less than key into other.
+ * Costs O(log n) with the AVL policy. The weak AVL policy cannot join its subtrees by rank along
+ * the split path, so it relinks all nodes into two perfectly balanced trees in O(n) instead.
+ * @param key the first key moved into other
+ * @param other the tree receiving the moved pairs, must be empty. It takes on this tree's key storage.
+ * @return returns true if the split was made, returns false if other was not empty, or a read of
+ * either tree started by beginRead has not ended, since versions are not moved.
+ */
+bool AVLTree::split(const string& key, AVLTree& other) {
+	if (other.size() != 0 || &other == this || hasReaders() || other.hasReaders()) {
+		return false;
+	}
+	other.clear();
+	dropVersions();
+	other.writeTimestamp = max(other.writeTimestamp, writeTimestamp);
+#ifdef AVLTREE_RANK_BALANCED
+	vector<AVLNode*> nodes;
+	nodes.reserve(size());
+	getAllNodes(root, nodes);
+	size_t middle = 0;
+	while (middle < nodes.size() && compareKey(key, nodes[middle]) > 0) {
+		middle++;
+	}
+	root = buildBalanced(nodes, 0, middle);
+	other.root = buildBalanced(nodes, middle, nodes.size());
+#else
+	AVLNode* left = nullptr;
+	AVLNode* right = nullptr;
+	splitNode(root, key, left, right);
+	root = left;
+	other.root = right;
+#endif
+	// the moved nodes keep their prefixes and memory, so other shares this tree's pools
+	other.prefixPool = prefixPool;
+	other.nodePool = nodePool;
+	other.retainedPools = retainedPools;
+	version++;
+	other.version++;
+	reportBulk(other.root, false);
+	other.reportBulk(other.root, true);
+#ifdef AVLTREE_VALIDATE
+	assert(validate() && other.validate());
+#endif
+	return true;
+}
+
+/**
+ * Moves every key-value pair of other into this tree, leaving other empty. Every key of other
+ * must be greater than every key of this tree. Costs O(log n) with the AVL policy, and
+ * O(n) with the weak AVL policy (see split). If the trees store keys differently, or have
+ * separate prefix pools, the keys of other are stored again in O(m).
+ * @param other the tree being joined onto the end of this tree
+ * @return returns true if the trees were joined, returns false if their keys overlap, or a read of
+ * either tree started by beginRead has not ended, since versions are not moved.
+ */
+bool AVLTree::join(AVLTree& other) {
+	if (&other == this || hasReaders() || other.hasReaders()) {
+		return false;
+	}
+	dropVersions();
+	other.dropVersions();
+	writeTimestamp = max(writeTimestamp, other.writeTimestamp);
+	// tombstones would take part in the key check below, purge them first
+	purgeTombstones();
+	other.purgeTombstones();
+	if (other.root == nullptr) {
+		return true;
+	}
+	// check that the largest key here is before the smallest key of other
+	AVLNode* smallest = other.root;
+	while (smallest->left != nullptr) {
+		smallest = smallest->left;
+	}
+	if (root != nullptr) {
+		AVLNode* largest = root;
+		while (largest->right != nullptr) {
+			largest = largest->right;
+		}
+		if (compareKey(largest->getKey(), smallest) >= 0) {
+			return false;
+		}
+	}
+	reportBulk(other.root, true);
+	other.reportBulk(other.root, false);
+	// nodes coming from a tree with another prefix pool have their keys stored again
+	if (other.prefixPool != prefixPool) {
+		adoptNodes(other.root, other.prefixPool.get());
+	}
+	// the memory of nodes coming from another node pool must live as long as this tree
+	for (const shared_ptr<NodePool>& pool : other.retainedPools) {
+		if (pool != nodePool && std::find(retainedPools.begin(), retainedPools.end(), pool) == retainedPools.end()) {
+			retainedPools.push_back(pool);
+		}
+	}
+	if (other.nodePool != nodePool && std::find(retainedPools.begin(), retainedPools.end(), other.nodePool) == retainedPools.end()) {
+		retainedPools.push_back(other.nodePool);
+	}
+#ifdef AVLTREE_RANK_BALANCED
+	vector<AVLNode*> nodes;
+	nodes.reserve(size() + other.size());
+	getAllNodes(root, nodes);
+	getAllNodes(other.root, nodes);
+	root = buildBalanced(nodes, 0, nodes.size());
+#else
+	// the smallest node of other becomes the node joining the two trees
+	AVLNode* middle = detachMin(other.root);
+	root = joinNodes(root, middle, other.root);
+#endif
+	other.root = nullptr;
+	version++;
+	other.version++;
+#ifdef AVLTREE_VALIDATE
+	assert(validate());
+#endif
+	return true;
+}
+
+/**
+ * Finds every key whose value differs between this tree and other, in key order. Both trees cache
+ * a hash of the entries of every subtree, so the count and hash of the entries in any key range
+ * are found in O(log n). Ranges whose counts and hashes match in both trees are skipped, and the
+ * others are halved until they are small enough to compare pair by pair, so the cost grows with the
+ * number of differences d, about O(d log^2 n), instead of with the size of the trees. The first diff
+ * after a tree is changed refreshes the hashes of the changed paths (of every node, the first time).
+ * Every write marks the hashes on its path out of date as it happens. diff is a read of both trees:
+ * it refreshes the cached hashes under each tree's hashLock, so it may run at the same time as other
+ * reads and diffs of the same trees.
+ * @param other the tree being compared against
+ * @return returns every key in either tree whose value is not the same in both, with its value in this
+ * tree (before) and in other (after).
+ */
+vector<AVLTree::Difference> AVLTree::diff(const AVLTree& other) const {
+	vector<Difference> differences;
+	if (&other != this) {
+		// scoped_lock takes both locks without deadlocking against a diff the other way around
+		scoped_lock guard(hashLock, other.hashLock);
+		diffRange(other, "", nullptr, differences);
+	}
+	return differences;
+}
+
+/**
+ * Copies every key-value pair of other which this tree is missing or holds with another value into
+ * this tree, keeping the keys which are only in this tree. Uses diff, so the cost grows with the
+ * number of differences. Listeners are told about each insert and update.
+ * @param other the tree being merged in
+ * @return returns the number of keys inserted or updated.
+ */
+size_t AVLTree::merge(const AVLTree& other) {
+	size_t merged = 0;
+	for (const Difference& difference : diff(other)) {
+		if (!difference.after.has_value()) {
+			continue;
+		}
+		update(difference.key, difference.after.value(), false);
+		merged++;
+	}
+	return merged;
+}
+
+/**
+ * Counts the memory used by the tree in O(n). The unused slots of slabs shared with trees this tree
+ * was split from, split into or joined with are split evenly between the trees sharing them, so the
+ * usage of every tree sharing a slab adds up to the slab once.
+ * @return returns the bytes used by nodes, keys and allocator slack.
+ */
+AVLTree::MemoryUsage AVLTree::memoryUsage() const {
+	MemoryUsage usage = {0, 0, 0, 0, 0, 0};
+	addMemoryUsage(root, usage);
+	usage.nodeBytes = usage.nodes * sizeof(AVLNode);
+	if (prefixPool != nullptr) {
+		lock_guard guard(prefixPool->lock);
+		size_t inlineCapacity = KeyType().capacity();
+		for (const pair<const KeyType, size_t>& entry : prefixPool->prefixes) {
+			// the hash table node holding the prefix, and the prefix itself if it does not fit inline
+			usage.keyBytes += sizeof(entry) + sizeof(void*);
+			if (entry.first.capacity() > inlineCapacity) {
+				usage.keyBytes += entry.first.capacity() + 1;
+			}
+		}
+	}
+	// every slot of a slab holds a node of some tree sharing the slab, is free, or was never handed out
+	auto addSlack = [&usage](const shared_ptr<NodePool>& pool) {
+		lock_guard guard(pool->lock);
+		size_t unused = pool->freeNodes.size();
+		for (const NodePool::Slab& slab : pool->slabs) {
+			unused += slab.capacity - slab.used;
+		}
+		usage.slackBytes += unused * sizeof(AVLNode) / static_cast<size_t>(pool.use_count());
+	};
+	for (const shared_ptr<NodePool>& pool : retainedPools) {
+		addSlack(pool);
+	}
+	addSlack(nodePool);
+	usage.totalBytes = usage.nodeBytes + usage.keyBytes + usage.slackBytes + usage.versionBytes;
+	return usage;
+}
+
+/**
+ * Moves every node into a single new slab, in the given order, and releases the slabs the nodes
+ * were in, unless another tree still shares them, which then reuses the slots the nodes left. Keys are shrunk to fit. Costs O(n) for in order,
+ * O(n log log n) for van Emde Boas order. Invalidates every finger, while references returned by
+ * operator[] and at hold keys and stay valid. The versions of the nodes move with them, so reads at a timestamp are not affected.
+ * @param order the order the nodes are laid out in
+ */
+void AVLTree::compact(NodeOrder order) {
+	vector<AVLNode*> nodes;
+	if (root != nullptr) {
+		nodes.reserve(root->count + root->tombstones);
+	}
+	if (order == NodeOrder::InOrder) {
+		getAllNodes(root, nodes);
+	} else if (root != nullptr) {
+		vanEmdeBoasOrder(root, root->height, nodes);
+	}
+
+	// move every node into the new slab, remembering where it went
+	shared_ptr<NodePool> pool = make_shared<NodePool>();
+	if (!nodes.empty()) {
+		pool->addSlab(nodes.size(), nodes.size());
+	}
+	AVLNode* slab = pool->slabs.empty() ? nullptr : reinterpret_cast<AVLNode*>(pool->slabs.back().memory.get());
+	unordered_map<AVLNode*, AVLNode*> moved;
+	moved.reserve(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++) {
+		AVLNode* node = new (slab + i) AVLNode(std::move(*nodes[i]));
+		node->key.shrink_to_fit();
+		nodes[i]->~AVLNode();
+		moved.emplace(nodes[i], node);
+	}
+	for (size_t i = 0; i < nodes.size(); i++) {
+		AVLNode* node = slab + i;
+		node->left = node->left != nullptr ? moved[node->left] : nullptr;
+		node->right = node->right != nullptr ? moved[node->right] : nullptr;
+	}
+	root = root != nullptr ? moved[root] : nullptr;
+	for (AVLNode*& node : versionedNodes) {
+		node = moved[node];
+	}
+
+	// the old slabs are released once no other tree shares them, until then the trees sharing them
+	// reuse the slots the nodes moved out of
+	if (sharesPools()) {
+		releaseNodes(nodes);
+	}
+	nodePool = pool;
+	retainedPools.clear();
+	version++;
+#ifdef AVLTREE_VALIDATE
+	assert(validate());
+#endif
+}
+
+/**
+ * Starts a read at the timestamp of the latest write. Until endRead is called with it, reads at that
+ * timestamp return what they would have returned right now, however the tree is changed meanwhile.
+ * Safe to call at the same time as other reads.
+ * @return returns the timestamp to read at.
+ */
+uint64_t AVLTree::beginRead() {
+	lock_guard guard(readerLock);
+	uint64_t timestamp = writeTimestamp;
+	readers.insert(timestamp);
+	newestReader.store(*readers.rbegin(), memory_order_relaxed);
+	return timestamp;
+}
+
+/**
+ * Ends a read started by beginRead. The versions only it could see are collected by the next write,
+ * or by collectVersions. Safe to call at the same time as other reads.
+ * @param timestamp the timestamp returned by beginRead
+ */
+void AVLTree::endRead(uint64_t timestamp) {
+	lock_guard guard(readerLock);
+	auto reader = readers.find(timestamp);
+	if (reader == readers.end()) {
+		return;
+	}
+	readers.erase(reader);
+	newestReader.store(readers.empty() ? 0 : *readers.rbegin(), memory_order_relaxed);
+	versionsStale.store(true, memory_order_relaxed);
+}
+
+/**
+ * @return returns the timestamp of the latest write.
+ */
+uint64_t AVLTree::getTimestamp() const {
+	return writeTimestamp;
+}
+
+/**
+ * Finds the value key had at a timestamp, in O(log n + v) where v is the number of versions of key
+ * written since.
+ * @param key the key associated with the return value
+ * @param timestamp a timestamp returned by beginRead and not yet ended, or the current timestamp
+ * @return returns the value associated with the key at timestamp, if it was in the tree then.
+ */
+std::optional<AVLTree::ValueType> AVLTree::get(const string& key, uint64_t timestamp) const {
+	const AVLNode* current = root;
+	while (current != nullptr) {
+		int comparison = compareKey(key, current);
+		if (comparison == 0) {
+			return valueAt(current, timestamp);
+		}
+		current = comparison < 0 ? current->left : current->right;
+	}
+	return nullopt;
+}
+
+/**
+ * Finds every value between the values of lowKey and highKey at a timestamp, in key order, like
+ * findRange(lowKey, highKey) run at that timestamp.
+ * @param lowKey the key associated with a lower value
+ * @param highKey the key associated with a higher value
+ * @param timestamp a timestamp returned by beginRead and not yet ended
+ * @return returns the values between those of lowKey and highKey at timestamp.
+ */
+vector<AVLTree::ValueType> AVLTree::findRange(const string& lowKey, const string& highKey, uint64_t timestamp) const {
+	struct Bounds {
+		ValueType low;
+		ValueType high;
+		vector<ValueType> range;
+	};
+	std::optional<ValueType> lowVal = get(lowKey, timestamp);
+	std::optional<ValueType> highVal = get(highKey, timestamp);
+	if (!lowVal.has_value() || !highVal.has_value()) {
+		return {};
+	}
+	Bounds bounds = {lowVal.value(), highVal.value(), {}};
+	KeyType scratch;
+	visitRange(root, nullptr, nullptr, timestamp, [](void* context, const KeyType&, ValueType value) {
+		Bounds* bounds = static_cast<Bounds*>(context);
+		if (value >= bounds->low && value <= bounds->high) {
+			bounds->range.push_back(value);
+		}
+	}, &bounds, scratch);
+	return std::move(bounds.range);
+}
+
+/**
+ * Finds every key-value pair whose key was in [lowKey, highKey) at a timestamp, in key order, like
+ * scanRange(lowKey, highKey) run at that timestamp.
+ * @param lowKey the first key included
+ * @param highKey the first key not included
+ * @param timestamp a timestamp returned by beginRead and not yet ended
+ * @return returns a vector of the key-value pairs in the range at timestamp.
+ */
+vector<pair<AVLTree::KeyType, AVLTree::ValueType>> AVLTree::scanRange(const string& lowKey, const string& highKey, uint64_t timestamp) const {
+	vector<pair<KeyType, ValueType>> entries;
+	KeyType scratch;
+	visitRange(root, &lowKey, &highKey, timestamp, [](void* context, const KeyType& key, ValueType value) {
+		static_cast<vector<pair<KeyType, ValueType>>*>(context)->emplace_back(key, value);
+	}, &entries, scratch);
+	return entries;
+}
+
+/**
+ * Prunes every version no active reader can see: of each node's history, only the newest state at
+ * the oldest reader's timestamp and the states after it are kept. Once there are no readers, the
+ * tombstones left by removes while there were readers are purged too, unless lazy deletion is on.
+ * Runs in O(h) for the h nodes with a history, and is run by the first write after a reader ends.
+ * @return returns the number of versions pruned.
+ */
+size_t AVLTree::collectVersions() {
+	versionsStale.store(false, memory_order_relaxed);
+	uint64_t oldest;
+	{
+		lock_guard guard(readerLock);
+		oldest = readers.empty() ? UINT64_MAX : *readers.begin();
+	}
+	size_t pruned = 0;
+	for (size_t i = 0; i < versionedNodes.size();) {
+		AVLNode* node = versionedNodes[i];
+		// find the newest state visible at oldest, everything older than it is pruned
+		unique_ptr<Version>* older = &node->history;
+		if (node->since > oldest) {
+			while (*older != nullptr && (*older)->since > oldest) {
+				older = &(*older)->older;
+			}
+			if (*older != nullptr) {
+				older = &(*older)->older;
+			}
+		}
+		// unlink the chain one version at a time, so a long one does not recurse
+		while (*older != nullptr) {
+			*older = std::move((*older)->older);
+			pruned++;
+		}
+		if (node->history == nullptr) {
+			versionedNodes[i] = versionedNodes.back();
+			versionedNodes.pop_back();
+		} else {
+			i++;
+		}
+	}
+	if (!lazyDeletion) {
+		purgeTombstones();
+	}
+	return pruned;
+}
+
+/**
+ * starts a write: takes the next timestamp, and collects versions first if a reader ended since the
+ * last collection, see collectVersions.
+ */
+void AVLTree::beginWrite() {
+	if (versionsStale.load(memory_order_relaxed)) {
+		collectVersions();
+	}
+	writeTimestamp++;
+}
+
+/**
+ * called before a write changes the value or deleted flag of node. Keeps the node's current state in
+ * its history if an active reader can see it, and stamps the node with the current write's timestamp.
+ * @param node the node about to change
+ */
+void AVLTree::recordVersion(AVLNode* node) {
+	if (newestReader.load(memory_order_relaxed) >= node->since) {
+		if (node->history == nullptr) {
+			versionedNodes.push_back(node);
+		}
+		node->history = make_unique<Version>(Version{node->value, node->deleted, node->since, std::move(node->history)});
+	}
+	node->since = writeTimestamp;
+}
+
+/**
+ * drops the history of every node, before a bulk operation moves or releases nodes without versioning them.
+ */
+void AVLTree::dropVersions() {
+	for (AVLNode* node : versionedNodes) {
+		while (node->history != nullptr) {
+			node->history = std::move(node->history->older);
+		}
+	}
+	versionedNodes.clear();
+}
+
+/**
+ * tells the listeners about every live entry of a subtree which a bulk operation added to or removed
+ * from the tree, see Listener.
+ * @param current the root of the subtree
+ * @param added true if the entries were added, false if they were removed
+ */
+void AVLTree::reportBulk(AVLNode* current, bool added) const {
+	if (listeners.empty()) {
+		return;
+	}
+	auto report = [this, added](const KeyType& key, ValueType value) {
+		for (Listener* listener : listeners) {
+			if (added) {
+				listener->onInsert(key, value);
+			} else {
+				listener->onRemove(key);
+			}
+		}
+	};
+	KeyType scratch;
+	visitRange(current, nullptr, nullptr, UINT64_MAX, [](void* context, const KeyType& key, ValueType value) {
+		(*static_cast<decltype(report)*>(context))(key, value);
+	}, &report, scratch);
+}
+
+/**
+ * @return returns true if a read started by beginRead has not ended yet.
+ */
+bool AVLTree::hasReaders() const {
+	return newestReader.load(memory_order_relaxed) != 0;
+}
+
+/**
+ * finds the state of a node at a timestamp.
+ * @param node the node being read
+ * @param timestamp the timestamp being read at
+ * @return returns the value of node at timestamp, or nothing if it was removed or not inserted yet.
+ */
+std::optional<AVLTree::ValueType> AVLTree::valueAt(const AVLNode* node, uint64_t timestamp) {
+	if (node->since <= timestamp) {
+		return node->deleted ? nullopt : std::optional<ValueType>(node->value);
+	}
+	for (const Version* old = node->history.get(); old != nullptr; old = old->older.get()) {
+		if (old->since <= timestamp) {
+			return old->deleted ? nullopt : std::optional<ValueType>(old->value);
+		}
+	}
+	return nullopt;
+}
+
+/**
+ * Registers a listener which is told about every later insert, remove and update.
+ * The listener must be removed before it is destroyed.
+ * @param listener the listener being added
+ */
+void AVLTree::addListener(Listener* listener) {
+	listeners.push_back(listener);
+}
+
+/**
+ * Unregisters a listener.
+ * @param listener the listener being removed
+ */
+void AVLTree::removeListener(Listener* listener) {
+	std::erase(listeners, listener);
+}
+
+/**
+ * Checks every invariant of the AVLTree in a single O(n) pass: the ordering of the nodes,
+ * the AVL balance factor of every node, and the cached height, count and tombstones of every node.
+ * Compiling with AVLTREE_VALIDATE runs this after every insert and remove.
+ * @return returns true if the tree is a valid AVLTree, returns false otherwise.
+ */
+bool AVLTree::validate() const {
+	size_t height = 0;
+	size_t count = 0;
+	size_t tombstones = 0;
+	return validateNode(root, nullptr, nullptr, height, count, tombstones);
+}
+
+/**
+ * Turns lazy deletion on or off. With lazy deletion on, remove only marks the node as a tombstone
+ * and updates the counts on its path, without unlinking or rebalancing anything. Reads skip tombstones,
+ * and inserting a removed key again revives its tombstone. Once tombstones make up more than
+ * compactionRatio of the nodes, every remove also purges a few of them, so they are compacted
+ * incrementally instead of all at once. Callers can purge more with purgeTombstones while idle.
+ * Turning lazy deletion off purges every tombstone.
+ * @param enabled true to remove lazily
+ * @param compactionRatio the share of nodes which may be tombstones before removes start purging them
+ */
+void AVLTree::setLazyDeletion(bool enabled, double compactionRatio) {
+	lazyDeletion = enabled;
+	this->compactionRatio = compactionRatio;
+	if (!enabled) {
+		purgeTombstones();
+	}
+}
+
+/**
+ * @return returns the number of removed nodes which have not been purged yet.
+ */
+size_t AVLTree::getTombstoneCount() const {
+	if (root == nullptr) {
+		return 0;
+	}
+	return root->tombstones;
+}
+
+/**
+ * Unlinks and releases up to limit tombstones, rebalancing after each one. Each one costs O(log n),
+ * since the tombstone counts lead straight to it. Nothing is purged while there are readers, see beginRead.
+ * @param limit the most tombstones purged
+ * @return returns the number of tombstones purged.
+ */
+size_t AVLTree::purgeTombstones(size_t limit) {
+	size_t purged = 0;
+	// readers at an older timestamp may still see the tombstones
+	if (hasReaders()) {
+		return 0;
+	}
+	while (purged < limit && purgeOne(root)) {
+		purged++;
+	}
+	if (purged > 0) {
+		version++;
+	}
+#ifdef AVLTREE_VALIDATE
+	assert(validate());
+#endif
+	return purged;
+}
+
+/**
+ * converts the AVLTree into an ostream, see dump.
+ * @param os ostream reference
+ * @param AVLTree the AVLTree being printed
+ * @return returns os
+ */
+std::ostream& operator<<(ostream& os, const AVLTree& AVLTree) {
+	AVLTree.dump(os);
+	return os;
+}
+
+/**
+ * appends key to out as the inside of a quoted string, escaping quotes, backslashes, and control
+ * characters the way JSON (or, with json false, the Graphviz DOT language) expects.
+ * @param out the string appended to
+ * @param key the key being quoted
+ * @param json true for JSON escapes, false for DOT escapes
+ */
+static void appendQuoted(string& out, const string& key, bool json) {
+	for (char c : key) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (static_cast<unsigned char>(c) < 0x20 && json) {
+			static const char HEX[] = "0123456789abcdef";
+			out += "\\u00";
+			out += HEX[c >> 4];
+			out += HEX[c & 0xf];
+		} else if (c == '\n') {
+			out += "\\n";
+		} else {
+			out += c;
+		}
+	}
+}
+
+/**
+ * Writes the tree to a stream in one of several formats, by an iterative walk which needs no
+ * recursion however deep the tree is. The output is built in memory and handed to the stream in
+ * chunks of DUMP_CHUNK bytes, and the stream is never flushed, so a large tree costs a few large
+ * writes instead of one flush per node.
+ *
+ * Text writes each entry as {key: value}, indented four spaces per level, larger keys first, so the
+ * tree reads sideways with its root on the left. Dot writes a Graphviz digraph, and JsonLines one
+ * object per node with its id, its parent's id, its side, depth, key, value, height, live count,
+ * and whether it is a tombstone. Text skips tombstones, the other formats show them.
+ * When a limit cuts the output short, a last line says so.
+ * @param os the stream written to
+ * @param format the format written
+ * @param maxDepth nodes deeper than this are left out, the root is at depth 0
+ * @param maxNodes the most nodes written
+ * @return returns the number of nodes written.
+ */
+size_t AVLTree::dump(ostream& os, DumpFormat format, size_t maxDepth, size_t maxNodes) const {
+	string out;
+	out.reserve(DUMP_CHUNK + 256);
+	KeyType scratch;
+	// the whole key of a node, assembled in scratch if it is prefix compressed
+	auto fullKey = [&scratch](const AVLNode* node) -> const KeyType& {
+		if (node->prefix == nullptr) {
+			return node->key;
+		}
+		scratch.assign(*node->prefix).append(node->key);
+		return scratch;
+	};
+	auto appendNumber = [&out](size_t number) {
+		char digits[24];
+		out.append(digits, to_chars(digits, digits + sizeof(digits), number).ptr);
+	};
+	size_t written = 0;
+	bool truncated = false;
+
+	if (format == DumpFormat::Text) {
+		// reverse inorder: right subtree, node, left subtree
+		vector<pair<AVLNode*, size_t>> stack;
+		AVLNode* current = root;
+		size_t depth = 0;
+		while (true) {
+			while (current != nullptr && depth <= maxDepth) {
+				stack.emplace_back(current, depth);
+				current = current->right;
+				depth++;
+			}
+			truncated |= current != nullptr;
+			if (stack.empty()) {
+				break;
+			}
+			auto [node, nodeDepth] = stack.back();
+			stack.pop_back();
+			if (!node->deleted) {
+				if (written == maxNodes) {
+					truncated = true;
+					break;
+				}
+				out.append(nodeDepth * 4, ' ');
+				out += '{';
+				out += fullKey(node);
+				out += ": ";
+				appendNumber(node->value);
+				out += "}\n";
+				written++;
+			}
+			current = node->left;
+			depth = nodeDepth + 1;
+			if (out.size() >= DUMP_CHUNK) {
+				os.write(out.data(), out.size());
+				out.clear();
+			}
+		}
+		if (truncated) {
+			out += "...\n";
+		}
+	} else {
+		// preorder, numbering the nodes as they are written
+		struct Pending {
+			AVLNode* node;
+			size_t depth;
+			size_t parent; // SIZE_MAX for the root
+			bool left;
+		};
+		vector<Pending> stack;
+		if (root != nullptr) {
+			stack.push_back({root, 0, SIZE_MAX, false});
+		}
+		if (format == DumpFormat::Dot) {
+			out += "digraph AVLTree {\n";
+		}
+		while (!stack.empty()) {
+			if (written == maxNodes) {
+				truncated = true;
+				break;
+			}
+			Pending pending = stack.back();
+			stack.pop_back();
+			AVLNode* node = pending.node;
+			size_t id = written++;
+			if (format == DumpFormat::Dot) {
+				out += "  n";
+				appendNumber(id);
+				out += " [label=\"";
+				appendQuoted(out, fullKey(node), false);
+				out += ": ";
+				appendNumber(node->value);
+				out += node->deleted ? "\", style=dashed];\n" : "\"];\n";
+				if (pending.parent != SIZE_MAX) {
+					out += "  n";
+					appendNumber(pending.parent);
+					out += " -> n";
+					appendNumber(id);
+					out += pending.left ? " [label=\"L\"];\n" : " [label=\"R\"];\n";
+				}
+			} else {
+				out += "{\"id\":";
+				appendNumber(id);
+				if (pending.parent == SIZE_MAX) {
+					out += ",\"parent\":null,\"side\":null";
+				} else {
+					out += ",\"parent\":";
+					appendNumber(pending.parent);
+					out += pending.left ? ",\"side\":\"left\"" : ",\"side\":\"right\"";
+				}
+				out += ",\"depth\":";
+				appendNumber(pending.depth);
+				out += ",\"key\":\"";
+				appendQuoted(out, fullKey(node), true);
+				out += "\",\"value\":";
+				appendNumber(node->value);
+				out += ",\"height\":";
+				appendNumber(node->height);
+				out += ",\"count\":";
+				appendNumber(node->count);
+				out += node->deleted ? ",\"deleted\":true}\n" : ",\"deleted\":false}\n";
+			}
+			// right is pushed first so the left subtree is written first
+			if (pending.depth < maxDepth) {
+				if (node->right != nullptr) {
+					stack.push_back({node->right, pending.depth + 1, id, false});
+				}
+				if (node->left != nullptr) {
+					stack.push_back({node->left, pending.depth + 1, id, true});
+				}
+			} else {
+				truncated |= node->left != nullptr || node->right != nullptr;
+			}
+			if (out.size() >= DUMP_CHUNK) {
+				os.write(out.data(), out.size());
+				out.clear();
+			}
+		}
+		if (format == DumpFormat::Dot) {
+			out += truncated ? "  // truncated\n}\n" : "}\n";
+		} else if (truncated) {
+			out += "{\"truncated\":true}\n";
+		}
+	}
+	os.write(out.data(), out.size());
+	return written;
+}
+
+/*
+=================
+= AVLNode Class =
+= ------------- =================================================
+= The AVLNode class defines the nodes which make up an AVLTree. =
+================================================================= */
+/**
+ * the default(empty) constructor of AVLNode
+ */
+AVLTree::AVLNode::AVLNode() {
+	this->key = "";
+	this->prefix = nullptr;
+	this->value = 0;
+	this->left = nullptr;
+	this->right = nullptr;
+	height = 1;
+	count = 1;
+	tombstones = 0;
+	deleted = false;
+	hashValid = false;
+	hash = 0;
+	since = 0;
+#ifdef AVLTREE_RANK_BALANCED
+	rank = 1;
+#endif
+}
+
+/**
+ * constructor with starting values for value and key
+ * @param key the key being loaded
+ * @param value the value being loaded
+ */
+AVLTree::AVLNode::AVLNode(std::string &key, size_t value) {
+	this->key = key;
+	this->prefix = nullptr;
+	this->value = value;
+	this->left = nullptr;
+	this->right = nullptr;
+	height = 1;
+	count = 1;
+	tombstones = 0;
+	deleted = false;
+	hashValid = false;
+	hash = 0;
+	since = 0;
+#ifdef AVLTREE_RANK_BALANCED
+	rank = 1;
+#endif
+}
+
+/**
+ * sets the key and value of the node
+ * @param key the key being loaded
+ * @param value the value being loaded
+ */
+void AVLTree::AVLNode::load(std::string &key, size_t value) {
+	this->key = key;
+	this->value = value;
+}
+
+/**
+ * sets the right reference to rightChild
+ * @param rightChild the new rightChild of this node
+ */
+void AVLTree::AVLNode::insertRight(AVLNode* rightChild) {
+	this->right = rightChild;
+}
+
+/**
+ * sets the left reference to leftChild
+ * @param leftChild the new leftChild of this node
+ */
+void AVLTree::AVLNode::insertLeft(AVLNode* leftChild) {
+	this->left = leftChild;
+}
+
+/**
+ * sets the height of the node
+ * @param height the new height
+ */
+void AVLTree::AVLNode::setHeight(int height) {
+	this->height = height;
+}
+
+// ACCESSORS //
+/**
+ * accessor for the key variable.
+ * @return returns the whole key of the node, including its shared prefix
+ */
+std::string AVLTree::AVLNode::getKey() const {
+	if (this->prefix != nullptr) {
+		return *this->prefix + this->key;
+	}
+	return this->key;
+}
+
+/**
+ * accessor for value
+ * @return returns the value of the AVLNode
+ */
+size_t AVLTree::AVLNode::getValue() {
+	return this->value;
+}
+
+/**
+ * accessor for height
+ * @return returns the height of the AVLNode
+ */
+size_t AVLTree::AVLNode::getHeight() {
+	return this->height;
+}
+
+/**
+ * alternate accessor for value which returns a reference
+ * @return returns a reference to value
+ */
+size_t &AVLTree::AVLNode::getValueRef() {
 	return this->value;
 }
 
@@ -407,20 +1854,239 @@ AVLTree::AVLNode *AVLTree::getRoot() const {
 	return root;
 }
 
+/**
+ * compares a key with the key of a node. Every search of the tree orders keys through this method.
+ * @param key the key being compared
+ * @param node the node being compared against
+ * @return returns a negative number if key is before node, 0 if they are equal, and a positive number otherwise.
+ */
+int AVLTree::compareKey(const KeyType& key, const AVLNode* node) const {
+	if (node->prefix == nullptr) {
+		return key.compare(node->key);
+	}
+	// compare against the prefix first, then the rest of the key, without joining them
+	const KeyType& prefix = *node->prefix;
+	int comparison = key.compare(0, prefix.size(), prefix);
+	if (comparison != 0) {
+		return comparison;
+	}
+	return key.compare(prefix.size(), KeyType::npos, node->key);
+}
+
+/**
+ * allocates a new node for a key-value pair, storing the key the way this tree stores keys.
+ * Safe to call from several threads at once.
+ * @param key the key of the node
+ * @param value the value of the node
+ * @param memory memory reserved for the node by reserveNodes, or nullptr to allocate it
+ * @return returns the new node.
+ */
+AVLTree::AVLNode* AVLTree::createNode(const KeyType& key, ValueType value, void* memory) {
+	AVLNode* node = new (memory != nullptr ? memory : allocateNode()) AVLNode();
+	node->value = value;
+	node->since = writeTimestamp;
+	storeKey(node, key);
+	return node;
+}
+
+/**
+ * releases a node and its share of its key prefix, returning its memory to the pool it came from
+ * for the next node created there. Safe to call from several threads at once.
+ * @param node the node being deleted
+ */
+void AVLTree::deleteNode(AVLNode* node) {
+	releasePrefix(node, prefixPool.get());
+	node->~AVLNode();
+	NodePool* pool = findPool(node);
+	lock_guard guard(pool->lock);
+	pool->freeNodes.push_back(node);
+}
+
+/**
+ * returns the memory of destroyed nodes to the pools they came from, taking each pool's lock once
+ * unless nodes were joined in from other pools.
+ * @param nodes the destroyed nodes
+ */
+void AVLTree::releaseNodes(const vector<AVLNode*>& nodes) {
+	if (retainedPools.empty()) {
+		lock_guard guard(nodePool->lock);
+		nodePool->freeNodes.insert(nodePool->freeNodes.end(), nodes.begin(), nodes.end());
+		return;
+	}
+	for (AVLNode* node : nodes) {
+		NodePool* pool = findPool(node);
+		lock_guard guard(pool->lock);
+		pool->freeNodes.push_back(node);
+	}
+}
+
+/**
+ * finds the pool whose slabs hold a node. A node freed into any other pool would outlive its memory
+ * once the pool it came from is released, while trees split from this one still use that free list.
+ * @param node the node
+ * @return returns the retained pool holding node, or this tree's own pool.
+ */
+/**
+ * @return returns true if another tree shares one of the node pools of this tree.
+ */
+bool AVLTree::sharesPools() const {
+	for (const shared_ptr<NodePool>& pool : retainedPools) {
+		if (pool.use_count() > 1) {
+			return true;
+		}
+	}
+	return nodePool.use_count() > 1;
+}
+
+AVLTree::NodePool* AVLTree::findPool(const AVLNode* node) const {
+	for (const shared_ptr<NodePool>& pool : retainedPools) {
+		lock_guard guard(pool->lock);
+		if (pool->owns(node)) {
+			return pool.get();
+		}
+	}
+	return nodePool.get();
+}
+
+/**
+ * reserves memory for count nodes in one slab of this tree's pool, so that a bulk operation can place
+ * its nodes without taking the pool's lock for each one.
+ * @param count the number of nodes
+ * @return returns the first of count consecutive nodes of memory, nullptr if count is 0.
+ */
+AVLTree::AVLNode* AVLTree::reserveNodes(size_t count) {
+	if (count == 0) {
+		return nullptr;
+	}
+	lock_guard guard(nodePool->lock);
+	vector<NodePool::Slab>& slabs = nodePool->slabs;
+	nodePool->addSlab(count, count);
+	AVLNode* first = reinterpret_cast<AVLNode*>(slabs.back().memory.get());
+	// keep handing out the rest of the slab which was in use before
+	if (slabs.size() > 1 && slabs[slabs.size() - 2].used < slabs[slabs.size() - 2].capacity) {
+		swap(slabs[slabs.size() - 2], slabs.back());
+	}
+	return first;
+}
+
+/**
+ * adds a slab to the pool. Requires lock to be held.
+ * @param capacity the number of nodes the slab holds
+ * @param used the number of nodes of the slab already handed out
+ */
+void AVLTree::NodePool::addSlab(size_t capacity, size_t used) {
+	slabs.push_back({make_unique_for_overwrite<byte[]>(capacity * sizeof(AVLNode)), capacity, used});
+	const byte* start = slabs.back().memory.get();
+	ranges.emplace(start, start + capacity * sizeof(AVLNode));
+}
+
+/**
+ * Requires lock to be held.
+ * @param node the node being looked for
+ * @return returns true if node lies in one of the pool's slabs.
+ */
+bool AVLTree::NodePool::owns(const AVLNode* node) const {
+	const byte* address = reinterpret_cast<const byte*>(node);
+	auto range = ranges.upper_bound(address);
+	if (range == ranges.begin()) {
+		return false;
+	}
+	--range;
+	return address < range->second;
+}
+
+/**
+ * hands out memory for one node, reusing a freed node if there is one, and adding a slab if the last
+ * slab is used up. Safe to call from several threads at once.
+ * @return returns memory for a node, which must be constructed with placement new.
+ */
+void* AVLTree::allocateNode() {
+	lock_guard guard(nodePool->lock);
+	if (!nodePool->freeNodes.empty()) {
+		AVLNode* node = nodePool->freeNodes.back();
+		nodePool->freeNodes.pop_back();
+		return node;
+	}
+	vector<NodePool::Slab>& slabs = nodePool->slabs;
+	if (slabs.empty() || slabs.back().used == slabs.back().capacity) {
+		nodePool->addSlab(SLAB_NODES, 0);
+	}
+	NodePool::Slab& slab = slabs.back();
+	return slab.memory.get() + sizeof(AVLNode) * slab.used++;
+}
+
+/**
+ * sets the key of a node. In a prefix compressed tree the part of key up to and including the last
+ * separator is interned in the prefix pool, and only the rest is stored in the node.
+ * @param node the node being changed, which must not hold a prefix
+ * @param key the whole key
+ */
+void AVLTree::storeKey(AVLNode* node, const KeyType& key) {
+	size_t split = prefixPool != nullptr ? key.rfind(prefixPool->separator) : KeyType::npos;
+	if (split == KeyType::npos) {
+		node->key = key;
+		node->prefix = nullptr;
+		return;
+	}
+	lock_guard guard(prefixPool->lock);
+	auto entry = prefixPool->prefixes.try_emplace(key.substr(0, split + 1), 0).first;
+	entry->second++;
+	node->prefix = &entry->first;
+	node->key.assign(key, split + 1);
+}
+
+/**
+ * gives up a node's use of its prefix, removing the prefix from the pool once no node uses it.
+ * @param node the node whose prefix is released, left holding no prefix
+ * @param pool the pool the prefix belongs to
+ */
+void AVLTree::releasePrefix(AVLNode* node, PrefixPool* pool) {
+	if (node->prefix == nullptr) {
+		return;
+	}
+	lock_guard guard(pool->lock);
+	auto entry = pool->prefixes.find(*node->prefix);
+	if (--entry->second == 0) {
+		pool->prefixes.erase(entry);
+	}
+	node->prefix = nullptr;
+}
+
+/**
+ * Recursively moves the keys of nodes which came from another tree into the way this tree stores keys.
+ * @param current the current node being moved
+ * @param from the prefix pool of the tree the nodes came from, nullptr if it had none
+ */
+void AVLTree::adoptNodes(AVLNode* current, PrefixPool* from) {
+	if (current == nullptr) {
+		return;
+	}
+	KeyType key = current->getKey();
+	if (from != nullptr) {
+		releasePrefix(current, from);
+	}
+	storeKey(current, key);
+	adoptNodes(current->left, from);
+	adoptNodes(current->right, from);
+}
+
 
 /**
  * Checks the balance of node, and performs necessary rotations if
- * the balance factor is less than -1, or greater than 1.
+ * the balance factor is less than -MAX_IMBALANCE, or greater than MAX_IMBALANCE.
  * @param node the node being balanced.
  */
 void AVLTree::balanceNode(AVLNode *&node) {
 	// Update height of Node and calculate balance factor. Abort if !node.
 	if (!node) return;
 	updateHeight(node);
+#ifdef AVLTREE_RANK_BALANCED
+	balanceRank(node);
+#else
 	int balanceFactor = getBalanceFactor(node);
 
-	// CASE 1: LEFT HEAVY (balanceFactor > 1)
-	if (balanceFactor > 1) {
+	// CASE 1: LEFT HEAVY (balanceFactor > MAX_IMBALANCE)
+	if (balanceFactor > MAX_IMBALANCE) {
 		// compute heights, and ensure nodes are not nullptr
 		int leftLeftHeight = -1;
 		int leftRightHeight = -1;
@@ -443,8 +2109,8 @@ void AVLTree::balanceNode(AVLNode *&node) {
 		}
 	}
 
-	// CASE 2: RIGHT HEAVY (balanceFactor < -1).
-	if (balanceFactor < -1) {
+	// CASE 2: RIGHT HEAVY (balanceFactor < -MAX_IMBALANCE).
+	if (balanceFactor < -MAX_IMBALANCE) {
 		//compute height, and ensure nodes are not nullptr
 		int rightRightHeight = -1;
 		int rightLeftHeight = -1;
@@ -464,7 +2130,117 @@ void AVLTree::balanceNode(AVLNode *&node) {
 			rotateLeft(node);
 		}
 	}
+#endif
+}
+
+#ifdef AVLTREE_RANK_BALANCED
+/**
+ * Restores the weak AVL rank rule at node using rank differences: every rank difference must be 1 or 2,
+ * and every leaf must have rank 1. Requires the subtrees of node to already follow the rule, so at most
+ * one violation is present. Promotions and demotions leave the violation to the parent, which is
+ * checked next on the way back up; a rotation always fixes the tree, so at most two are done per update.
+ * @param node the node being balanced.
+ */
+void AVLTree::balanceRank(AVLNode *&node) {
+	int leftDiff = node->rank - getRank(node->left);
+	int rightDiff = node->rank - getRank(node->right);
+
+	// CASE 1: INSERT, a child has the same rank as node
+	if (leftDiff == 0 || rightDiff == 0) {
+		bool leftHigh = leftDiff == 0;
+		int siblingDiff = leftHigh ? rightDiff : leftDiff;
+		// 0,1 node: promote and let the parent check itself
+		if (siblingDiff == 1) {
+			node->rank++;
+			return;
+		}
+		// 0,2 node: rotate the high child up
+		AVLNode* high = leftHigh ? node->left : node->right;
+		AVLNode* outer = leftHigh ? high->left : high->right;
+		AVLNode* inner = leftHigh ? high->right : high->left;
+		if (high->rank - getRank(outer) == 1) {
+			node->rank--;
+		} else {
+			inner->rank++;
+			high->rank--;
+			node->rank--;
+			if (leftHigh) {
+				rotateLeft(node->left);
+			} else {
+				rotateRight(node->right);
+			}
+		}
+		if (leftHigh) {
+			rotateRight(node);
+		} else {
+			rotateLeft(node);
+		}
+		return;
+	}
+
+	// CASE 2: REMOVE, a 2,2 leaf is demoted and the parent checks itself
+	if (node->isLeaf()) {
+		node->rank = 1;
+		return;
+	}
+
+	// CASE 3: REMOVE, a child is three ranks lower than node
+	if (leftDiff == 3 || rightDiff == 3) {
+		bool leftLow = leftDiff == 3;
+		AVLNode* sibling = leftLow ? node->right : node->left;
+		int siblingDiff = leftLow ? rightDiff : leftDiff;
+		// 3,2 node: demote and let the parent check itself
+		if (siblingDiff == 2) {
+			node->rank--;
+			return;
+		}
+		AVLNode* outer = leftLow ? sibling->right : sibling->left;
+		AVLNode* inner = leftLow ? sibling->left : sibling->right;
+		int outerDiff = sibling->rank - getRank(outer);
+		int innerDiff = sibling->rank - getRank(inner);
+		// 3,1 node with a 2,2 sibling: demote both and let the parent check itself
+		if (outerDiff == 2 && innerDiff == 2) {
+			node->rank--;
+			sibling->rank--;
+			return;
+		}
+		if (outerDiff == 1) {
+			// single rotation, node is demoted twice if it becomes a leaf
+			sibling->rank++;
+			node->rank--;
+			if (inner == nullptr && (leftLow ? node->left : node->right) == nullptr) {
+				node->rank--;
+			}
+		} else {
+			// double rotation
+			inner->rank += 2;
+			sibling->rank--;
+			node->rank -= 2;
+			if (leftLow) {
+				rotateRight(node->right);
+			} else {
+				rotateLeft(node->left);
+			}
+		}
+		if (leftLow) {
+			rotateLeft(node);
+		} else {
+			rotateRight(node);
+		}
+	}
+}
+
+/**
+ * @param node the node being checked
+ * @return returns the rank of node, or 0 if node is nullptr
+ */
+int AVLTree::getRank(AVLNode* node) const {
+	if (node == nullptr) {
+		return 0;
+	}
+	return node->rank;
 }
+#endif
 
 /**
  * This returns the height as an int instead of a size_t because CLion gets annoyed when I mix int and size_t variables.
@@ -475,19 +2251,17 @@ int AVLTree::AVLNode::getHeightInteger() {
 }
 
 /**
- * Updates the height of a node by checking the height of the right and left subtree.
- * Requires the height of left and right to be accurate
+ * Updates the height, count and tombstones of a node by checking those of the right and left subtree,
+ * and marks its cached hash out of date. Requires the height, count and tombstones of left and right to be accurate
  * @param node the node being updated
  */
 void AVLTree::updateHeight(AVLNode*& node) {
 	if (!node) return;
+	updateCounts(node);
 
 	// get heights of both subtrees, set to 0 if null.
 	int leftHeight = 0;
 	int rightHeight = 0;
-	int height;
-
-	// check for nullptrs, and get heights.
 	if (node->left != nullptr) {
 		leftHeight = node->left->getHeightInteger();
 	}
@@ -503,6 +2277,61 @@ void AVLTree::updateHeight(AVLNode*& node) {
 	}
 }
 
+/**
+ * Updates the count and tombstones of a node from those of its subtrees, and marks its cached hash
+ * out of date, leaving its height alone.
+ * @param node the node being updated
+ */
+void AVLTree::updateCounts(AVLNode* node) {
+	node->hashValid = false;
+	size_t count = node->deleted ? 0 : 1;
+	size_t tombstones = node->deleted ? 1 : 0;
+	if (node->left != nullptr) {
+		count += node->left->count;
+		tombstones += node->left->tombstones;
+	}
+	if (node->right != nullptr) {
+		count += node->right->count;
+		tombstones += node->right->tombstones;
+	}
+	node->count = count;
+	node->tombstones = tombstones;
+}
+
+/**
+ * @param node the root of a subtree, or nullptr
+ * @return returns the height of the subtree, and in a weak AVL tree its rank, see retrace.
+ */
+AVLTree::Shape AVLTree::shapeOf(const AVLNode* node) {
+	if (node == nullptr) {
+		return {0, 0};
+	}
+#ifdef AVLTREE_RANK_BALANCED
+	return {node->height, node->rank};
+#else
+	return {node->height, 0};
+#endif
+}
+
+/**
+ * Updates node on the way back up after one of its subtrees changed. If that subtree kept its shape,
+ * node is as balanced as it was and keeps its height, so only its counts are updated and every ancestor
+ * can stop checking its balance too. Otherwise node is rebalanced.
+ * @param node the node being updated
+ * @param child the subtree which changed, as it is now
+ * @param before the shape child had before it changed
+ * @return returns true if the subtree rooted at node kept its shape.
+ */
+bool AVLTree::retrace(AVLNode*& node, const AVLNode* child, Shape before) {
+	if (shapeOf(child) == before) {
+		updateCounts(node);
+		return true;
+	}
+	Shape shape = shapeOf(node);
+	balanceNode(node);
+	return shapeOf(node) == shape;
+}
+
 /**
  * checks the balance factor of an individual node.
  *
@@ -542,6 +2371,7 @@ AVLTree::AVLNode* AVLTree::rotateLeft(AVLNode *&node) {
 	// then perform rotation
 	AVLNode* right = node->right;
 	AVLNode* rightLeft = right->left;
+	rotations++;
 
 	right->left = node;
 	node->right = rightLeft;
@@ -566,6 +2396,7 @@ AVLTree::AVLNode* AVLTree::rotateRight(AVLNode *&node) {
 	// then perform rotation
 	AVLNode* left = node->left;
 	AVLNode* leftRight = node->left->right;
+	rotations++;
 
 	left->right = node;
 	node->left = leftRight;
@@ -578,54 +2409,285 @@ AVLTree::AVLNode* AVLTree::rotateRight(AVLNode *&node) {
 }
 
 /**
- * performs a left then right rotation at the provided node
- * @param node the node being rotated
- * @return returns a reference to the node
+ * performs a left then right rotation at the provided node
+ * @param node the node being rotated
+ * @return returns a reference to the node
+ */
+AVLTree::AVLNode* AVLTree::rotateLeftRight(AVLNode *&node) {
+	// left rotate node->left, then right rotate node
+	rotateLeft(node->left);
+	return rotateRight(node);
+}
+
+/**
+ * performs a right then left rotation at the provided node
+ * @param node the node being rotated
+ * @return returns a reference to the node
+ */
+AVLTree::AVLNode* AVLTree::rotateRightLeft(AVLNode *&node) {
+	// right rotate node->right, then left rotate node
+	rotateRight(node->right);
+	return rotateLeft(node);
+}
+
+
+/**
+ * recursively gets the height of both subtrees via inorder traversal.
+ *
+ * @param current the current node being visited
+ * @return returns the height of the AVLTree.
+ */
+size_t AVLTree::height(AVLNode* current) const {
+	// BASE CASE: if nullptr, return empty list
+	if (current == nullptr) {
+		return 0;
+	}
+	// get the height of both subtrees, and return 1 + the larger subtree as the height
+	size_t leftHeight = height(current->left);
+	size_t rightHeight = height(current->right);
+	if (leftHeight > rightHeight) {
+		return 1 + leftHeight;
+	}
+	return 1 + rightHeight;
+}
+
+/**
+ * Recursive helper method of validate. Uses postorder traversal so that the heights and counts of
+ * both subtrees are known before current is checked.
+ * @param current the current node being checked
+ * @param low the closest ancestor current must be ordered after, nullptr if there is none
+ * @param high the closest ancestor current must be ordered before, nullptr if there is none
+ * @param height set to the actual height of the subtree rooted at current
+ * @param count set to the actual number of live nodes in the subtree rooted at current
+ * @param tombstones set to the actual number of deleted nodes in the subtree rooted at current
+ * @return returns true if the subtree rooted at current is valid, returns false otherwise.
+ */
+bool AVLTree::validateNode(AVLNode* current, const AVLNode* low, const AVLNode* high, size_t& height, size_t& count, size_t& tombstones) const {
+	// BASE CASE: an empty subtree is always valid
+	if (current == nullptr) {
+		height = 0;
+		count = 0;
+		tombstones = 0;
+		return true;
+	}
+	// check ordering against the ancestors bounding this subtree
+	if (low != nullptr && compareKey(low->getKey(), current) >= 0) {
+		return false;
+	}
+	if (high != nullptr && compareKey(high->getKey(), current) <= 0) {
+		return false;
+	}
+	// check both subtrees
+	size_t leftHeight, leftCount, leftTombstones, rightHeight, rightCount, rightTombstones;
+	if (!validateNode(current->left, low, current, leftHeight, leftCount, leftTombstones)) {
+		return false;
+	}
+	if (!validateNode(current->right, current, high, rightHeight, rightCount, rightTombstones)) {
+		return false;
+	}
+	height = 1 + (leftHeight > rightHeight ? leftHeight : rightHeight);
+	count = (current->deleted ? 0 : 1) + leftCount + rightCount;
+	tombstones = (current->deleted ? 1 : 0) + leftTombstones + rightTombstones;
+
+#ifdef AVLTREE_RANK_BALANCED
+	// check the rank rule: every rank difference is 1 or 2, and every leaf has rank 1
+	int leftDiff = current->rank - getRank(current->left);
+	int rightDiff = current->rank - getRank(current->right);
+	if (leftDiff < 1 || leftDiff > 2 || rightDiff < 1 || rightDiff > 2) {
+		return false;
+	}
+	if (current->isLeaf() && current->rank != 1) {
+		return false;
+	}
+#else
+	// check the balance factor and the cached values
+	int balanceFactor = static_cast<int>(leftHeight) - static_cast<int>(rightHeight);
+	if (balanceFactor > MAX_IMBALANCE || balanceFactor < -MAX_IMBALANCE) {
+		return false;
+	}
+#endif
+	// every older version was written before the one after it
+	uint64_t newer = current->since;
+	for (const Version* old = current->history.get(); old != nullptr; old = old->older.get()) {
+		if (old->since >= newer) {
+			return false;
+		}
+		newer = old->since;
+	}
+	return current->height == height && current->count == count && current->tombstones == tombstones;
+}
+
+/**
+ * recursive helper method of split and join. Collects every node of a subtree using inorder traversal.
+ * @param current the current node being collected
+ * @param nodes the vector the nodes are added to
+ */
+void AVLTree::getAllNodes(AVLNode* current, vector<AVLNode*>& nodes) const {
+	if (current == nullptr) {
+		return;
+	}
+	getAllNodes(current->left, nodes);
+	nodes.push_back(current);
+	getAllNodes(current->right, nodes);
+}
+
+/**
+ * recursive helper method of memoryUsage. Counts the nodes of a subtree and the heap bytes of their keys.
+ * @param current the current node being counted
+ * @param usage the counts being added to
+ */
+void AVLTree::addMemoryUsage(AVLNode* current, MemoryUsage& usage) const {
+	if (current == nullptr) {
+		return;
+	}
+	usage.nodes++;
+	// a key which fits inline in the string uses no heap
+	if (current->key.capacity() > KeyType().capacity()) {
+		usage.keyBytes += current->key.capacity() + 1;
+	}
+	for (const Version* old = current->history.get(); old != nullptr; old = old->older.get()) {
+		usage.versionBytes += sizeof(Version);
+	}
+	addMemoryUsage(current->left, usage);
+	addMemoryUsage(current->right, usage);
+}
+
+/**
+ * recursive helper method of compact. Lists the top levels of a subtree first, laid out recursively the
+ * same way, then each subtree hanging below them from left to right. A search then reads one small
+ * block of nodes for every half of the height it descends.
+ * @param current the root of the subtree
+ * @param levels the height of the subtree, or the number of its top levels being listed
+ * @param nodes the vector the nodes are added to
+ */
+void AVLTree::vanEmdeBoasOrder(AVLNode* current, size_t levels, vector<AVLNode*>& nodes) const {
+	if (current == nullptr || levels == 0) {
+		return;
+	}
+	if (levels == 1) {
+		nodes.push_back(current);
+		return;
+	}
+	size_t top = levels / 2;
+	vanEmdeBoasOrder(current, top, nodes);
+	vector<AVLNode*> bottoms;
+	collectAtDepth(current, top, bottoms);
+	for (AVLNode* bottom : bottoms) {
+		vanEmdeBoasOrder(bottom, levels - top, nodes);
+	}
+}
+
+/**
+ * recursive helper method of vanEmdeBoasOrder. Lists the nodes at a depth below a node, from left to right.
+ * @param current the current node
+ * @param depth the depth of the nodes listed, below current
+ * @param nodes the vector the nodes are added to
+ */
+void AVLTree::collectAtDepth(AVLNode* current, size_t depth, vector<AVLNode*>& nodes) const {
+	if (current == nullptr) {
+		return;
+	}
+	if (depth == 0) {
+		nodes.push_back(current);
+		return;
+	}
+	collectAtDepth(current->left, depth - 1, nodes);
+	collectAtDepth(current->right, depth - 1, nodes);
+}
+
+/**
+ * Recursively relinks nodes[low, high), which must be in key order, into a perfectly balanced subtree.
+ * The heights and counts (and ranks) of every node are set on the way back up.
+ * @param nodes the nodes being linked
+ * @param low the first node of the subtree
+ * @param high one past the last node of the subtree
+ * @return returns the root of the subtree, nullptr if it is empty.
  */
-AVLTree::AVLNode* AVLTree::rotateLeftRight(AVLNode *&node) {
-	// left rotate node->left, then right rotate node
-	rotateLeft(node->left);
-	return rotateRight(node);
+AVLTree::AVLNode* AVLTree::buildBalanced(vector<AVLNode*>& nodes, size_t low, size_t high) {
+	// BASE CASE: empty subtree
+	if (low >= high) {
+		return nullptr;
+	}
+	size_t middle = low + (high - low) / 2;
+	AVLNode* current = nodes[middle];
+	current->left = buildBalanced(nodes, low, middle);
+	current->right = buildBalanced(nodes, middle + 1, high);
+	updateHeight(current);
+#ifdef AVLTREE_RANK_BALANCED
+	current->rank = static_cast<int>(current->height);
+#endif
+	return current;
 }
 
 /**
- * performs a right then left rotation at the provided node
- * @param node the node being rotated
- * @return returns a reference to the node
+ * Recursive helper method of join and split. Joins two subtrees and a middle node, where every key of
+ * left is before middle and every key of right is after it. Descends the spine of the taller subtree until
+ * both sides have about the same height, links them under middle there, and rebalances on the way back up.
+ * Costs O(difference in height).
+ * @param left the subtree with the smaller keys
+ * @param middle the node between the two subtrees
+ * @param right the subtree with the larger keys
+ * @return returns the root of the joined subtree.
  */
-AVLTree::AVLNode* AVLTree::rotateRightLeft(AVLNode *&node) {
-	// right rotate node->right, then left rotate node
-	rotateRight(node->right);
-	return rotateLeft(node);
+AVLTree::AVLNode* AVLTree::joinNodes(AVLNode* left, AVLNode* middle, AVLNode* right) {
+	int leftHeight = left != nullptr ? left->getHeightInteger() : 0;
+	int rightHeight = right != nullptr ? right->getHeightInteger() : 0;
+	// CASE 1: left is taller, join down its right spine
+	if (leftHeight > rightHeight + 1) {
+		left->right = joinNodes(left->right, middle, right);
+		balanceNode(left);
+		return left;
+	}
+	// CASE 2: right is taller, join down its left spine
+	if (rightHeight > leftHeight + 1) {
+		right->left = joinNodes(left, middle, right->left);
+		balanceNode(right);
+		return right;
+	}
+	// CASE 3: about the same height, middle becomes their parent
+	middle->left = left;
+	middle->right = right;
+	updateHeight(middle);
+	return middle;
 }
 
-
 /**
- * recursively gets the height of both subtrees via inorder traversal.
- *
- * @param current the current node being visited
- * @return returns the height of the AVLTree.
+ * Recursive helper method of split. Splits a subtree into the nodes before key and the nodes not before
+ * key, rejoining the pieces on the way back up. Costs O(log n) since the joins telescope.
+ * @param current the root of the subtree being split
+ * @param key the first key of the right side
+ * @param left set to the subtree of keys before key
+ * @param right set to the subtree of keys not before key
  */
-size_t AVLTree::height(AVLNode* current) const {
-	// BASE CASE: if nullptr, return empty list
+void AVLTree::splitNode(AVLNode* current, const string& key, AVLNode*& left, AVLNode*& right) {
+	// BASE CASE: nothing left to split
 	if (current == nullptr) {
-		return 0;
+		left = nullptr;
+		right = nullptr;
+		return;
 	}
-	// get the height of both subtrees, and return 1 + the larger subtree as the height
-	size_t leftHeight = height(current->left);
-	size_t rightHeight = height(current->right);
-	if (leftHeight > rightHeight) {
-		return 1 + leftHeight;
+	AVLNode* currentLeft = current->left;
+	AVLNode* currentRight = current->right;
+	if (compareKey(key, current) <= 0) {
+		// current and its right subtree belong on the right side
+		AVLNode* splitRight = nullptr;
+		splitNode(currentLeft, key, left, splitRight);
+		right = joinNodes(splitRight, current, currentRight);
+	} else {
+		// current and its left subtree belong on the left side
+		AVLNode* splitLeft = nullptr;
+		splitNode(currentRight, key, splitLeft, right);
+		left = joinNodes(currentLeft, current, splitLeft);
 	}
-	return 1 + rightHeight;
 }
 
 /**
  * Recursive helper method of insert.
  *
  * Base case occurs when insertNode reaches a nullptr,
- * this means it is where the new value should be inserted.
+ * this means it is where the new key should be inserted.
  *
+ * @param key the key being added to the AVLTree
  * @param val the value being added to the AVLTree
  * @param current the current node
  * @return returns true if the key-value pair was inserted. Returns false otherwise.
@@ -633,33 +2695,73 @@ size_t AVLTree::height(AVLNode* current) const {
 bool AVLTree::insertNode(std::string& key, size_t val, AVLNode *&current) {
 	// base case: current is nullptr. Insert here. //
 	if (current == nullptr) {
-		current = new AVLNode(key, val);
+		current = createNode(key, val);
 		return true;
 	}
 
-	// if value > currValue, continue down right subtree, and vise versa.
-	if (val > current->getValue()) { // right subtree
-		if (insertNode(key, val, current->getRight())) {
-			updateHeight(current);
-			balanceNode(current);
-			return true;
-		} else {
-			std::cout << "FAILED INSERT";
+	// if key > currKey, continue down right subtree, and vise versa.
+	int comparison = compareKey(key, current);
+	if (comparison == 0) {
+		// duplicate keys are not inserted, a removed key is inserted again by reviving its tombstone
+		if (!current->deleted) {
 			return false;
 		}
+		recordVersion(current);
+		current->deleted = false;
+		current->value = val;
+		updateCounts(current);
+		return true;
 	}
-	else if (val < current->getValue()) {
-		// left subtree
-		if (insertNode(key, val, current->getLeft())) {
-			updateHeight(current);
-			balanceNode(current);
-			return true;
-		} else {
-			std::cout << "FAILED INSERT";
-			return false;
+	AVLNode*& child = comparison > 0 ? current->getRight() : current->getLeft();
+	Shape before = shapeOf(child);
+	bool inserted = insertNode(key, val, child);
+	if (inserted) {
+		retrace(current, child, before);
+	}
+	return inserted;
+}
+
+/**
+ * Recursive helper method of operator[] and increment. Finds the node of key, creating it with the
+ * value 0 where the search ends if key is not in the tree, and rebalances on the way back up.
+ *
+ * @param key the key being searched for
+ * @param current the current node
+ * @param found set to the node of key
+ * @return returns true if the node was created (or a tombstone revived), returns false if it was found.
+ */
+bool AVLTree::findOrInsert(const KeyType& key, AVLNode*& current, AVLNode*& found) {
+	// BASE CASE 1: key not in tree, insert it here
+	if (current == nullptr) {
+		current = createNode(key, 0);
+		found = current;
+		return true;
+	}
+	// the caller may write the value, so the hashes on the path go out of date either way
+	current->hashValid = false;
+	int comparison = compareKey(key, current);
+	bool inserted;
+	if (comparison == 0) {
+		// BASE CASE 2: key found, reviving it if it was removed lazily
+		found = current;
+		recordVersion(current);
+		inserted = current->deleted;
+		if (inserted) {
+			current->deleted = false;
+			current->value = 0;
+		}
+		if (inserted) {
+			updateCounts(current);
+		}
+	} else {
+		AVLNode*& child = comparison < 0 ? current->left : current->right;
+		Shape before = shapeOf(child);
+		inserted = findOrInsert(key, child, found);
+		if (inserted) {
+			retrace(current, child, before);
 		}
 	}
-	return false;
+	return inserted;
 }
 
 /**
@@ -669,43 +2771,27 @@ bool AVLTree::insertNode(std::string& key, size_t val, AVLNode *&current) {
  * @param key the key of the node being removed.
  * @return returns true if the node was removed, returns false otherwise.
  */
-bool AVLTree:: remove(AVLNode *&current, KeyType key, size_t value) {
+bool AVLTree::remove(AVLNode *&current, const KeyType& key) {
 	// BASE CASE 1: nullptr, key not in tree //
 	if (current == nullptr) {
 		return false;
 	}
-	bool result = false;
-
 	// BASE CASE 2: key found //
-	if (current->getKey() == key) {
-		if (removeNode(current)) {
-			return true;
-		}
-		return false; // shouldn't be reached in theory
+	int comparison = compareKey(key, current);
+	if (comparison == 0) {
+		// a tombstone's key is already gone
+		return !current->deleted && removeNode(current);
 	}
 
-	// Recurse down right subtree
-	if (value > current->getValue()) {
-		result = remove(current->left, key, value);
-		if (remove(current->getRight(), key, value)) {
-			updateHeight(current);
-			balanceNode(current);
-			return true;
-		}
-	}
-	// Recurse down left subtree
-	else if (value < current->getValue()) {
-		if (remove(current->getLeft(), key, value)) {
-			updateHeight(current);
-			balanceNode(current);
-			return true;
-		}
-	}
+	// Recurse down only the subtree which can hold key
+	AVLNode*& child = comparison > 0 ? current->getRight() : current->getLeft();
+	Shape before = shapeOf(child);
+	bool result = remove(child, key);
 	// if successful, update height and rebalance
-	if (!result) return false;
-	updateHeight(current);
-	balanceNode(current);
-	return true;
+	if (result) {
+		retrace(current, child, before);
+	}
+	return result;
 }
 
 /**
@@ -733,27 +2819,98 @@ bool AVLTree::removeNode(AVLNode*& current){
 		}
 	} else {
 		// CASE 3 - Two children
-		// get the smallest key in the right subtree
-		AVLNode* smallestInRight = current->right;
-
-		while (smallestInRight->left) {
-			smallestInRight = smallestInRight->left;
-		}
-		std::string newKey = smallestInRight->key;
-		int newValue = smallestInRight->value;
-		remove(root, smallestInRight->key, smallestInRight->value); // delete this one
+		// detach the smallest node in the right subtree and put it in the place of current.
+		// Removing it from current->right directly keeps every rotation below current, so the
+		// reference to current stays valid.
+		AVLNode* smallestInRight = detachMin(current->right);
+		smallestInRight->left = current->left;
+		smallestInRight->right = current->right;
+#ifdef AVLTREE_RANK_BALANCED
+		smallestInRight->rank = current->rank;
+#endif
+		current = smallestInRight;
+		balanceNode(current);
+	}
+	deleteNode(toDelete);
 
-		current->key = newKey;
-		current->value = newValue;
+	return true;
+}
 
-		current->height = current->getHeight();
-		balanceNode(current);
+/**
+ * recursive helper method of remove when lazy deletion is on. Marks the node holding key as a
+ * tombstone and updates the counts on the way back up. No node moves, so nothing is rebalanced.
+ *
+ * @param current the current node being checked
+ * @param key the key of the node being removed
+ * @return returns true if the node was marked, returns false if key is not in the tree.
+ */
+bool AVLTree::markDeleted(AVLNode* current, const KeyType& key) {
+	// BASE CASE: nullptr, key not in tree
+	if (current == nullptr) {
+		return false;
+	}
+	int comparison = compareKey(key, current);
+	bool marked;
+	if (comparison == 0) {
+		marked = !current->deleted;
+		if (marked) {
+			recordVersion(current);
+		}
+		current->deleted = true;
+	} else if (comparison < 0) {
+		marked = markDeleted(current->left, key);
+	} else {
+		marked = markDeleted(current->right, key);
+	}
+	if (marked) {
+		updateHeight(current);
+	}
+	return marked;
+}
 
-		return true; // we already deleted the one we needed to so return
+/**
+ * recursive helper method of purgeTombstones. Follows the tombstone counts down to a tombstone,
+ * removes it, and rebalances on the way back up.
+ *
+ * @param current the root of the subtree being purged
+ * @return returns true if a tombstone was removed, returns false if the subtree has none.
+ */
+bool AVLTree::purgeOne(AVLNode*& current) {
+	// BASE CASE 1: no tombstones below
+	if (current == nullptr || current->tombstones == 0) {
+		return false;
 	}
-	delete toDelete;
+	// BASE CASE 2: current is a tombstone
+	if (current->deleted) {
+		return removeNode(current);
+	}
+	AVLNode*& child = current->left != nullptr && current->left->tombstones > 0 ? current->left : current->right;
+	Shape before = shapeOf(child);
+	bool purged = purgeOne(child);
+	if (purged) {
+		retrace(current, child, before);
+	}
+	return purged;
+}
 
-	return true;
+/**
+ * helper method of removeNode which unlinks the smallest node of a subtree,
+ * rebalancing every node on the way back up.
+ *
+ * @param current the root of the subtree, must not be nullptr
+ * @return returns the unlinked node
+ */
+AVLTree::AVLNode* AVLTree::detachMin(AVLNode*& current) {
+	// BASE CASE: no left child, current is the smallest node. Replace it with its right subtree.
+	if (current->left == nullptr) {
+		AVLNode* smallest = current;
+		current = current->right;
+		return smallest;
+	}
+	Shape before = shapeOf(current->left);
+	AVLNode* smallest = detachMin(current->left);
+	retrace(current, current->left, before);
+	return smallest;
 }
 
 /**
@@ -767,73 +2924,508 @@ std::optional<size_t> AVLTree::get(const string& key, AVLNode* current) const {
 	if (current == nullptr) {
 		return nullopt;
 	}
-	// recurse left
-	optional<size_t> result = get(key, current->left);
-	if (result.has_value()) {
-		return result;
-	}
-
 	// BASE CASE 2: key found, return //
-	if (current->getKey() == key) {
+	int comparison = compareKey(key, current);
+	if (comparison == 0) {
+		if (current->deleted) {
+			return nullopt;
+		}
 		return current->getValue();
 	}
-	// recurse right
-	result = get(key, current->right);
-	if (result.has_value()) {
-		return result;
+	// recurse into the subtree which can hold key
+	if (comparison < 0) {
+		return get(key, current->left);
 	}
-	return nullopt;
+	return get(key, current->right);
 }
 
 /**
- * Recursive helper method of ~AVLTree. Destroys all nodes
- * in the tree using postorder traversal.
+ * Recursive helper method of clear. Destroys all nodes
+ * in the tree using postorder traversal, destroying the left subtree
+ * on a new thread while more than one thread is left.
  * @param current the current node being destroyed
+ * @param threads the threads left for this subtree
+ * @param freed collects the memory of the destroyed nodes for releaseNodes, or nullptr if their pools
+ * are released whole
  */
-void AVLTree::destroy(AVLNode *&current) {
+void AVLTree::destroy(AVLNode *&current, size_t threads, vector<AVLNode*>* freed) {
 	if (current == nullptr) return;
-	// go down subtrees before destroying node
-	destroy(current->left);
-	destroy(current->right);
-	delete current;
+	// go down subtrees before destroying node, each thread collecting its own nodes
+	if (threads > 1 && current->count >= PARALLEL_CUTOFF) {
+		auto left = async(launch::async, [this, current, threads, freed]() {
+			vector<AVLNode*> leftFreed;
+			destroy(current->left, threads / 2, freed != nullptr ? &leftFreed : nullptr);
+			return leftFreed;
+		});
+		destroy(current->right, threads - threads / 2, freed);
+		vector<AVLNode*> leftFreed = left.get();
+		if (freed != nullptr) {
+			freed->insert(freed->end(), leftFreed.begin(), leftFreed.end());
+		}
+	} else {
+		destroy(current->left, 1, freed);
+		destroy(current->right, 1, freed);
+	}
+	releasePrefix(current, prefixPool.get());
+	current->~AVLNode();
+	if (freed != nullptr) {
+		freed->push_back(current);
+	}
 }
 
 /**
- * Recursive helper method of the deep copy constructor. Uses pre-order traversal.
+ * Recursive helper method of the deep copy constructor. Copies every node, tombstones included, along with its
+ * height and count, using pre-order traversal, and copies the left subtree on a new thread
+ * while more than one thread is left. The copies are placed in slots in pre-order, the order they
+ * are made in, so the threads never share an allocator.
  * @param current current node being copied
+ * @param threads the threads left for this subtree
+ * @param slots memory for the nodes of the subtree, see reserveNodes
+ * @return returns the copy of current.
  */
-void AVLTree::createDeepCopy(AVLNode *current) {
+AVLTree::AVLNode* AVLTree::createDeepCopy(AVLNode *current, size_t threads, AVLNode* slots) {
 	if (current == nullptr) {
-		return;
+		return nullptr;
 	}
-	// insert current
-	insert(current->getKey(), current->getValue());
+	size_t leftNodes = current->left != nullptr ? current->left->count + current->left->tombstones : 0;
+	// copy current
+	AVLNode* copy = createNode(current->getKey(), current->value, slots);
+	copy->height = current->height;
+	copy->count = current->count;
+	copy->tombstones = current->tombstones;
+	copy->deleted = current->deleted;
+	copy->hashValid = current->hashValid;
+	copy->hash = current->hash;
+	copy->since = current->since;
+#ifdef AVLTREE_RANK_BALANCED
+	copy->rank = current->rank;
+#endif
 	// recurse left, then right
-	createDeepCopy(current->left);
-	createDeepCopy(current->right);
+	if (threads > 1 && current->count >= PARALLEL_CUTOFF) {
+		auto left = async(launch::async, [this, current, threads, slots]() {
+			return createDeepCopy(current->left, threads / 2, slots + 1);
+		});
+		copy->right = createDeepCopy(current->right, threads - threads / 2, slots + 1 + leftNodes);
+		copy->left = left.get();
+	} else {
+		copy->left = createDeepCopy(current->left, 1, slots + 1);
+		copy->right = createDeepCopy(current->right, 1, slots + 1 + leftNodes);
+	}
+	return copy;
+}
+
+/**
+ * hashes a key-value pair for the subtree hashes. Equal pairs hash the same in every tree, whatever
+ * its shape or key storage.
+ * @param key the whole key
+ * @param value the value
+ * @return returns the hash of the pair.
+ */
+static uint64_t hashEntry(const string& key, size_t value) {
+	// splitmix64 finalizer, so that sums of hashes of similar pairs don't cancel out
+	uint64_t hash = std::hash<string>{}(key) + 0x9e3779b97f4a7c15ULL * (static_cast<uint64_t>(value) + 1);
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+/**
+ * Recursive helper method of diff. Finds the sum of the hashes of every live entry in a subtree,
+ * using and refreshing the hashes cached in the nodes. Sums are taken modulo 2^64, so they do not
+ * depend on the shape of the tree and the sum over a range is the difference of two prefix sums.
+ * @param current the root of the subtree
+ * @return returns the hash of the subtree, 0 if it is empty.
+ */
+uint64_t AVLTree::subtreeHash(AVLNode* current) const {
+	if (current == nullptr) {
+		return 0;
+	}
+	if (!current->hashValid) {
+		current->hash = subtreeHash(current->left) + subtreeHash(current->right);
+		if (!current->deleted) {
+			current->hash += hashEntry(current->getKey(), current->value);
+		}
+		current->hashValid = true;
+	}
+	return current->hash;
+}
+
+/**
+ * finds the number of live entries before key and the sum of their hashes, in O(log n).
+ * @param key the first key not counted
+ * @param count set to the number of entries before key
+ * @param hash set to the sum of the hashes of the entries before key
+ */
+void AVLTree::summarizeBelow(const KeyType& key, size_t& count, uint64_t& hash) const {
+	count = 0;
+	hash = 0;
+	AVLNode* current = root;
+	while (current != nullptr) {
+		if (compareKey(key, current) <= 0) {
+			current = current->left;
+			continue;
+		}
+		// current and its left subtree are before key
+		if (current->left != nullptr) {
+			count += current->left->count;
+			hash += subtreeHash(current->left);
+		}
+		if (!current->deleted) {
+			count++;
+			hash += hashEntry(current->getKey(), current->value);
+		}
+		current = current->right;
+	}
+}
+
+/**
+ * finds the number of live entries whose keys are in [lowKey, highKey), and the sum of their hashes.
+ * @param lowKey the first key counted
+ * @param highKey the first key not counted, nullptr if there is no upper bound
+ * @param count set to the number of entries in the range
+ * @param hash set to the sum of the hashes of the entries in the range
+ */
+void AVLTree::summarizeRange(const KeyType& lowKey, const KeyType* highKey, size_t& count, uint64_t& hash) const {
+	size_t lowCount;
+	uint64_t lowHash;
+	summarizeBelow(lowKey, lowCount, lowHash);
+	if (highKey == nullptr) {
+		count = size();
+		hash = subtreeHash(root);
+	} else {
+		summarizeBelow(*highKey, count, hash);
+	}
+	count -= lowCount;
+	hash -= lowHash;
+}
+
+/**
+ * Recursive helper method of diff. Compares the entries of both trees whose keys are in [lowKey, highKey).
+ * Equal counts and hashes are taken to mean equal entries, since a collision of 64 bit sums is vanishingly
+ * unlikely. Small ranges are compared pair by pair, larger ones are split at
+ * the middle key of the tree holding more entries in the range.
+ * @param other the tree being compared against
+ * @param lowKey the first key compared
+ * @param highKey the first key not compared, nullptr if there is no upper bound
+ * @param differences the vector the differences are added to, in key order
+ */
+void AVLTree::diffRange(const AVLTree& other, const KeyType& lowKey, const KeyType* highKey, vector<Difference>& differences) const {
+	size_t count, otherCount;
+	uint64_t hash, otherHash;
+	summarizeRange(lowKey, highKey, count, hash);
+	other.summarizeRange(lowKey, highKey, otherCount, otherHash);
+	if (count == otherCount && hash == otherHash) {
+		return;
+	}
+	// BASE CASE: few enough entries to merge the two ranges in key order
+	if (count + otherCount <= DIFF_CUTOFF) {
+		vector<pair<KeyType, ValueType>> entries, otherEntries;
+		scanRange(root, lowKey, highKey, entries);
+		other.scanRange(other.root, lowKey, highKey, otherEntries);
+		size_t i = 0, j = 0;
+		while (i < entries.size() || j < otherEntries.size()) {
+			int comparison = i == entries.size() ? 1 : j == otherEntries.size() ? -1 : entries[i].first.compare(otherEntries[j].first);
+			if (comparison < 0) {
+				differences.push_back({std::move(entries[i].first), entries[i].second, nullopt});
+				i++;
+			} else if (comparison > 0) {
+				differences.push_back({std::move(otherEntries[j].first), nullopt, otherEntries[j].second});
+				j++;
+			} else {
+				if (entries[i].second != otherEntries[j].second) {
+					differences.push_back({std::move(entries[i].first), entries[i].second, otherEntries[j].second});
+				}
+				i++;
+				j++;
+			}
+		}
+		return;
+	}
+	// split at the middle key of the larger side, both halves then hold fewer of its entries
+	const AVLTree& larger = count >= otherCount ? *this : other;
+	size_t below;
+	uint64_t unused;
+	larger.summarizeBelow(lowKey, below, unused);
+	KeyType middle = larger.keyAt(below + max(count, otherCount) / 2).value();
+	diffRange(other, lowKey, &middle, differences);
+	diffRange(other, middle, highKey, differences);
+}
+
+/**
+ * recursive helper method of floorEntry.
+ * @param current the root of the subtree being searched
+ * @param key the key being searched for
+ * @return returns the live node of the subtree with the largest key not greater than key, nullptr if there is none.
+ */
+AVLTree::AVLNode* AVLTree::floorNode(AVLNode* current, const KeyType& key) const {
+	if (current == nullptr) {
+		return nullptr;
+	}
+	int comparison = compareKey(key, current);
+	if (comparison < 0) {
+		return floorNode(current->left, key);
+	}
+	// the right subtree holds the larger candidates, then current, then the left subtree
+	AVLNode* found = comparison > 0 ? floorNode(current->right, key) : nullptr;
+	if (found == nullptr && !current->deleted) {
+		found = current;
+	}
+	if (found == nullptr) {
+		found = lastLive(current->left);
+	}
+	return found;
+}
+
+/**
+ * helper method of floorNode. Follows the live counts to the last live node of a subtree, in O(log n).
+ * @param current the root of the subtree
+ * @return returns the live node with the largest key, nullptr if the subtree has none.
+ */
+AVLTree::AVLNode* AVLTree::lastLive(AVLNode* current) const {
+	while (current != nullptr && current->count > 0) {
+		if (current->right != nullptr && current->right->count > 0) {
+			current = current->right;
+		} else if (!current->deleted) {
+			return current;
+		} else {
+			current = current->left;
+		}
+	}
+	return nullptr;
 }
 
 /**
- * Recursive helper method for operator[].
+ * Recursive helper method for const at.
  * @param key the key being searched for
  * @param current the current node being checked
  * @return returns the node associated with the key if it is found, returns nullptr otherwise.
  */
-AVLTree::AVLNode* AVLTree::getNodeRef(const string& key, AVLNode* current) {
+AVLTree::AVLNode* AVLTree::getNodeRef(const string& key, AVLNode* current) const {
 	// BASE CASE 1: nullptr, key not in tree //
 	if (current == nullptr) {
 		return nullptr;
 	}
-	// recurse left
-	AVLNode* result = getNodeRef(key, current->left);
-	if (result != nullptr) return result;
-
 	// BASE CASE 2: key found, return //
-	if (current->getKey() == key) {
-		return current;
+	int comparison = compareKey(key, current);
+	if (comparison == 0) {
+		return current->deleted ? nullptr : current;
 	}
-	// recurse right
-	result = getNodeRef(key, current->right);
-	if (result != nullptr) return result;
-	return nullptr;
-}
\ No newline at end of file
+	// recurse into the subtree which can hold key
+	if (comparison < 0) {
+		return getNodeRef(key, current->left);
+	}
+	return getNodeRef(key, current->right);
+}
+
+/*
+================
+= Finger Class =
+= ------------ ===============================================
+= A Finger is a saved search path used for localized search. =
+============================================================== */
+/**
+ * creates an empty finger, the first search through it starts from root.
+ */
+AVLTree::Finger::Finger() : tree(nullptr), version(0) {}
+
+/**
+ * @return returns the key the finger points at, or nothing if the finger is empty or out of date.
+ */
+std::optional<AVLTree::KeyType> AVLTree::Finger::key() const {
+	if (tree == nullptr || version != tree->version || path.empty() || *path.back().slot == nullptr
+		|| (*path.back().slot)->deleted) {
+		return nullopt;
+	}
+	return (*path.back().slot)->getKey();
+}
+
+/**
+ * @return returns the value the finger points at, or nothing if the finger is empty or out of date.
+ */
+std::optional<AVLTree::ValueType> AVLTree::Finger::value() const {
+	if (tree == nullptr || version != tree->version || path.empty() || *path.back().slot == nullptr
+		|| (*path.back().slot)->deleted) {
+		return nullopt;
+	}
+	return (*path.back().slot)->value;
+}
+
+/**
+ * Moves a finger to the slot where key is, or where it would be inserted. The finger first walks up
+ * its path until it reaches a subtree whose bounds contain key, then descends from there, so
+ * a search for a key d positions away from the finger costs O(log d) instead of O(log n).
+ * An empty or out of date finger starts from root.
+ * @param finger the finger being moved
+ * @param key the key being searched for
+ */
+void AVLTree::seek(Finger& finger, const string& key) const {
+	vector<Finger::Step>& path = finger.path;
+	if (finger.tree != this || finger.version != version || path.empty()) {
+		// the finger only writes through its slots in insert, which is not const
+		path.clear();
+		path.push_back({const_cast<AVLNode**>(&root), nullptr, nullptr});
+		finger.tree = this;
+		finger.version = version;
+	}
+	// walk up until key is inside the bounds of the subtree
+	while (path.size() > 1) {
+		const Finger::Step& step = path.back();
+		bool aboveLow = step.low == nullptr || compareKey(key, step.low) > 0;
+		bool belowHigh = step.high == nullptr || compareKey(key, step.high) < 0;
+		if (aboveLow && belowHigh) {
+			break;
+		}
+		path.pop_back();
+	}
+	// descend to key
+	while (*path.back().slot != nullptr) {
+		Finger::Step step = path.back();
+		AVLNode* current = *step.slot;
+		int comparison = compareKey(key, current);
+		if (comparison == 0) {
+			return;
+		}
+		if (comparison < 0) {
+			path.push_back({&current->left, step.low, current});
+		} else {
+			path.push_back({&current->right, current, step.high});
+		}
+	}
+}
+
+/**
+ * Inserts a new key-value pair, starting the search from hint instead of root. Finding the position
+ * costs O(log d) comparisons, where d is the distance from the hint's previous position, and the insert
+ * does at most two rotations. The insert as a whole is still O(log n): every ancestor up to root caches
+ * the number of entries in its subtree (which keyAt and the range counts rely on), so each one must be
+ * updated. That walk follows the path the hint already holds and compares no keys, and above the first
+ * subtree which kept its shape only the counts and hashes are refreshed, as in retrace.
+ *
+ * @param hint the finger the search starts from, left pointing at key after the insert
+ * @param key the key being inserted
+ * @param value the value being inserted
+ * @return returns true if the insertion is successful, returns false if the key was already in the tree.
+ */
+bool AVLTree::insert(Finger& hint, const string& key, size_t value) {
+	beginWrite();
+	seek(hint, key);
+	vector<Finger::Step>& path = hint.path;
+	AVLNode* found = *path.back().slot;
+	if (found != nullptr && !found->deleted) {
+		return false;
+	}
+	if (found != nullptr) {
+		// revive the tombstone, nothing moves so only the counts on the path change
+		recordVersion(found);
+		found->deleted = false;
+		found->value = value;
+		for (size_t i = path.size(); i-- > 0;) {
+			updateCounts(*path[i].slot);
+		}
+		version++;
+		hint.version = version;
+		for (Listener* listener : listeners) {
+			listener->onInsert(key, value);
+		}
+		return true;
+	}
+	*path.back().slot = createNode(key, value);
+
+	// rebalance every ancestor up to the first subtree which kept its shape, then only update counts,
+	// remembering the highest ancestor where a rotation happened
+	size_t rotatedAt = path.size();
+	bool settled = false;
+	for (size_t i = path.size() - 1; i-- > 0;) {
+		AVLNode*& node = *path[i].slot;
+		if (settled) {
+			updateCounts(node);
+			continue;
+		}
+		AVLNode* before = node;
+		Shape shape = shapeOf(node);
+		balanceNode(node);
+		if (node != before) {
+			rotatedAt = i;
+		}
+		settled = shapeOf(node) == shape;
+	}
+	version++;
+	hint.version = version;
+	for (Listener* listener : listeners) {
+		listener->onInsert(key, value);
+	}
+
+	// the path below a rotation no longer exists, search again from the rotated subtree
+	if (rotatedAt < path.size()) {
+		path.resize(rotatedAt + 1);
+		seek(hint, key);
+	}
+#ifdef AVLTREE_VALIDATE
+	assert(validate());
+#endif
+	return true;
+}
+
+/**
+ * Moves a finger to the first key which is not less than key, starting the search from where the
+ * finger already is. Scanning forward through nearly sorted keys costs O(log d) per call,
+ * where d is the distance from the previous position.
+ *
+ * @param finger the finger being moved
+ * @param key the key being searched for
+ * @return returns true if such a key exists. Otherwise returns false and leaves the finger empty.
+ */
+bool AVLTree::lowerBoundFrom(Finger& finger, const string& key) const {
+	seek(finger, key);
+	vector<Finger::Step>& path = finger.path;
+	if (*path.back().slot == nullptr) {
+		// key is not in the tree, the lower bound is the deepest ancestor the search went left from
+		size_t i = path.size() - 1;
+		while (i > 0 && path[i].slot != &(*path[i - 1].slot)->left) {
+			i--;
+		}
+		if (i == 0) {
+			path.clear();
+			return false;
+		}
+		path.resize(i);
+	}
+	// removed keys are skipped
+	while ((*path.back().slot)->deleted) {
+		if (!advance(finger)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Moves a finger from the node it points at to the next node in key order, tombstones included.
+ * @param finger the finger being moved, which must point at a node
+ * @return returns true if there is a next node. Otherwise returns false and leaves the finger empty.
+ */
+bool AVLTree::advance(Finger& finger) const {
+	vector<Finger::Step>& path = finger.path;
+	AVLNode* current = *path.back().slot;
+	if (current->right != nullptr) {
+		// the next node is the smallest node of the right subtree
+		const AVLNode* high = path.back().high;
+		path.push_back({&current->right, current, high});
+		while ((*path.back().slot)->left != nullptr) {
+			AVLNode* node = *path.back().slot;
+			const AVLNode* low = path.back().low;
+			path.push_back({&node->left, low, node});
+		}
+		return true;
+	}
+	// otherwise it is the deepest ancestor whose left subtree holds current
+	while (path.size() > 1) {
+		bool fromLeft = path.back().slot == &(*path[path.size() - 2].slot)->left;
+		path.pop_back();
+		if (fromLeft) {
+			return true;
+		}
+	}
+	path.clear();
+	return false;
+}
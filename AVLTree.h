@@ -1,43 +1,188 @@
 /**
  * AVLTree.h
+ *
+ * Compile with AVLTREE_RANK_BALANCED to balance the tree as a weak AVL (rank-balanced) tree
+ * instead of a strict AVL tree. Weak AVL trees do at most two rotations per insert or remove
+ * and O(1) amortized rank changes, at the cost of a height bound of 2log(n) instead of 1.44log(n).
+ *
+ * Reads can be made at a timestamp: beginRead returns the timestamp of the latest write, and until
+ * endRead is called, get, findRange and scanRange at that timestamp see the tree as it was then, however
+ * it is changed meanwhile, including through the references returned by operator[] and at. Writes keep
+ * the older values such readers may need in a version chain on each node, and removes leave tombstones
+ * while there are readers, so neither a global lock held for the whole query nor a snapshot copy of
+ * the tree is needed. Versions no reader can see any more are
+ * pruned by collectVersions. Like every other call, these must still be synchronized with writes, for
+ * example by a shared_mutex held shared by each read call and exclusively by each write call. While a
+ * read is active, the bulk operations which would lose versions refuse to run: load, split and join
+ * return false, and clear and assignment throw. compact keeps the versions.
+ *
+ * Compile with AVLTREE_RELAXED_BALANCE=k to let the heights of the two subtrees of a node differ by
+ * up to k instead of 1. Bursts of inserts then rotate much less and write fewer nodes, at the cost of a
+ * taller tree, about (k + 1)log(n) high at worst. AVLTREE_RELAXED_BALANCE=1 is a strict AVL tree.
  */
 
 #ifndef AVLTREE_H
 #define AVLTREE_H
+#if defined(AVLTREE_RANK_BALANCED) && defined(AVLTREE_RELAXED_BALANCE)
+#error "AVLTREE_RELAXED_BALANCE relaxes the AVL policy, it cannot be combined with AVLTREE_RANK_BALANCED"
+#endif
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 using namespace std;
 
 class AVLTree {
 public:
+    using KeyType = std::string;
+    using ValueType = size_t;
+
+	/**
+	 * How keys are stored in the nodes. PrefixCompressed splits every key after its last separator,
+	 * stores each distinct prefix once per tree, and keeps only the rest of the key in the node.
+	 * Keys sharing long prefixes (tenant/region/object/...) then mostly fit in the node's inline
+	 * string storage instead of each needing their own heap allocation.
+	 */
+	enum class KeyStorage {
+		Full,
+		PrefixCompressed
+	};
+
+	class ValueReference;
+
 	AVLTree();
+	explicit AVLTree(KeyStorage storage, char separator = '/');
 	~AVLTree();
 
 	AVLTree(const AVLTree& other);
-	size_t& operator[](const std::string& key);
-	void operator=(const AVLTree& other);
-    using KeyType = std::string;
-    using ValueType = size_t;
+	ValueReference operator[](const std::string& key);
+	ValueReference at(const std::string& key);
+	const size_t& at(const std::string& key) const;
+	AVLTree& operator=(const AVLTree& other);
 
 	bool insert(const string& key, size_t value);
 	bool remove(const string& key);
+	ValueType increment(const string& key, ValueType delta = 1);
 	bool contains(const string& key) const;
 	std::optional<size_t> get(const string& key) const;
+	vector<std::optional<ValueType>> getBatch(const vector<KeyType>& keys, size_t group = 16) const;
 	vector<size_t> findRange(const std::string& lowKey, const std::string& highKey) const;
+	void findRange(const string& lowKey, const string& highKey, vector<ValueType>& buffer) const;
+	template <typename OutputIterator> requires output_iterator<OutputIterator, const ValueType&>
+	OutputIterator findRange(const string& lowKey, const string& highKey, OutputIterator out) const;
 	vector<std::string> keys() const;
+	vector<std::string> keys(size_t threads) const;
+	void keys(vector<KeyType>& buffer) const;
+	template <typename OutputIterator> requires output_iterator<OutputIterator, const KeyType&>
+	OutputIterator keys(OutputIterator out) const;
+	template <typename Function>
+	void forEach(Function&& function) const;
+	template <typename Function>
+	void forEachInRange(const string& lowKey, const string& highKey, Function&& function) const;
+	vector<pair<KeyType, ValueType>> entries() const;
+	vector<pair<KeyType, ValueType>> entries(size_t threads) const;
+	vector<pair<KeyType, ValueType>> scanRange(const string& lowKey, const string& highKey) const;
+	vector<pair<KeyType, ValueType>> scanPrefix(const string& prefix) const;
+	KeyStorage getKeyStorage() const;
+	std::optional<KeyType> keyAt(size_t index) const;
+	std::optional<pair<KeyType, ValueType>> floorEntry(const string& key) const;
 	size_t size() const;
 	size_t getHeight() const;
+	size_t getRotationCount() const;
+	bool validate() const;
+
+	void setLazyDeletion(bool enabled, double compactionRatio = 0.25);
+	size_t getTombstoneCount() const;
+	size_t purgeTombstones(size_t limit = SIZE_MAX);
+
+	bool load(const vector<pair<KeyType, ValueType>>& entries, size_t threads = 0);
+	void clear(size_t threads = 1);
+	bool split(const string& key, AVLTree& other);
+	bool join(AVLTree& other);
+
+	// a key whose value differs between two trees, nothing standing for a missing key
+	struct Difference {
+		KeyType key;
+		std::optional<ValueType> before;
+		std::optional<ValueType> after;
+	};
+
+	vector<Difference> diff(const AVLTree& other) const;
+	size_t merge(const AVLTree& other);
+
+	// the order compact lays nodes out in memory
+	enum class NodeOrder {
+		InOrder, // in key order, so scans read memory front to back
+		VanEmdeBoas // recursively by halves of the height, so each search touches few cache lines
+	};
+
+	// the bytes used by a tree, see memoryUsage
+	struct MemoryUsage {
+		size_t nodes; // nodes in the tree, tombstones included
+		size_t nodeBytes; // bytes of those nodes
+		size_t keyBytes; // heap bytes of keys too long to be stored in their node, and of shared prefixes
+		size_t slackBytes; // bytes of unused node slots, this tree's share of those in slabs shared with other trees
+		size_t versionBytes; // bytes of older values kept for readers, see beginRead
+		size_t totalBytes;
+	};
+
+	MemoryUsage memoryUsage() const;
+	void compact(NodeOrder order = NodeOrder::InOrder);
+
+	uint64_t beginRead();
+	void endRead(uint64_t timestamp);
+	uint64_t getTimestamp() const;
+	std::optional<ValueType> get(const string& key, uint64_t timestamp) const;
+	vector<ValueType> findRange(const string& lowKey, const string& highKey, uint64_t timestamp) const;
+	vector<pair<KeyType, ValueType>> scanRange(const string& lowKey, const string& highKey, uint64_t timestamp) const;
+	size_t collectVersions();
+
+	// the formats dump writes
+	enum class DumpFormat {
+		Text, // one line per entry indented by its depth, larger keys first, as printed by operator<<
+		Dot, // a Graphviz digraph of every node, tombstones dashed
+		JsonLines // one JSON object per node, in preorder
+	};
+
+	size_t dump(ostream& os, DumpFormat format = DumpFormat::Text, size_t maxDepth = SIZE_MAX, size_t maxNodes = SIZE_MAX) const;
 
 	friend std::ostream& operator<<(ostream& os, const AVLTree & avlTree);
 
 protected:
+	// an earlier state of a node, kept for readers at an older timestamp
+	struct Version {
+		ValueType value;
+		bool deleted;
+		uint64_t since; // the timestamp of the write which made this state visible
+		unique_ptr<Version> older;
+	};
+
     class AVLNode {
     public:
-        KeyType key;
+        KeyType key; // the whole key, or only the part after prefix
+        const KeyType* prefix; // the shared prefix of key in a prefix compressed tree, or nullptr
         ValueType value;
         size_t height;
+        size_t count; // number of live nodes in the subtree rooted here
+        size_t tombstones; // number of deleted nodes in the subtree rooted here
+        bool deleted; // removed lazily, skipped by every read until purged
+        bool hashValid; // false once the subtree changed since hash was computed, refreshed under hashLock
+        uint64_t hash; // the sum of the hashes of every live entry in the subtree, see subtreeHash
+        uint64_t since; // the timestamp of the write which gave the node its value and deleted flag
+        unique_ptr<Version> history; // the states before since, newest first, kept only while a reader may need them
+#ifdef AVLTREE_RANK_BALANCED
+        int rank; // weak AVL rank, a missing child has rank 0 and a leaf has rank 1
+#endif
         AVLNode* left;
         AVLNode* right;
 
@@ -49,7 +194,7 @@ protected:
     	void insertLeft(AVLNode* leftChild);
     	void setHeight(int height);
 
-    	std::string getKey();
+    	std::string getKey() const;
     	size_t getValue();
     	size_t& getValueRef();
 		AVLNode *&getLeft();
@@ -63,12 +208,181 @@ protected:
         size_t getHeight() const;
     };
 
+public:
+	/**
+	 * A Finger remembers the path from root to a position in the tree, so that a search for a nearby
+	 * key only walks up as far as the smallest subtree containing both keys before descending again.
+	 * A Finger is invalidated by any insert or remove not made through it, after which it
+	 * silently restarts from root.
+	 */
+	class Finger {
+	public:
+		Finger();
+		std::optional<KeyType> key() const;
+		std::optional<ValueType> value() const;
+
+	private:
+		friend class AVLTree;
+		// a slot (root or a child pointer) on the path, and the keys bounding its subtree
+		struct Step {
+			AVLNode** slot;
+			const AVLNode* low;
+			const AVLNode* high;
+		};
+		vector<Step> path;
+		const AVLTree* tree;
+		size_t version;
+	};
+
+	bool insert(Finger& hint, const string& key, size_t value);
+	bool lowerBoundFrom(Finger& finger, const string& key) const;
+
+	/**
+	 * The value of a key, as returned by operator[] and at. Reading it reads the value in the tree, and
+	 * each write through it is a write to the tree like increment, so listeners, reads at a timestamp
+	 * and diff see it as it happens. It holds the key rather than the node, so it stays valid as long
+	 * as the tree, whatever is inserted, removed or compacted meanwhile. Once its key is removed, it
+	 * reads as 0 and a write inserts the key again, like operator[]. Every access costs O(log n).
+	 */
+	class ValueReference {
+	public:
+		ValueReference(const ValueReference& other) = default;
+		operator ValueType() const;
+		ValueReference& operator=(ValueType value);
+		ValueReference& operator=(const ValueReference& other);
+		ValueReference& operator+=(ValueType delta);
+		ValueReference& operator-=(ValueType delta);
+		ValueReference& operator++();
+		ValueReference& operator--();
+		ValueType operator++(int);
+		ValueType operator--(int);
+
+	private:
+		friend class AVLTree;
+		ValueReference(AVLTree& tree, const KeyType& key);
+		AVLTree* tree;
+		KeyType key;
+	};
+
+	/**
+	 * A Listener is told about every insert, remove, and update (by increment, or a write through the
+	 * reference returned by operator[] or at), as it happens. Bulk operations report every entry they
+	 * add or remove, one by one: load and assignment as inserts, clear as removes, and split and join as
+	 * removes from the tree losing the entries and inserts into the tree gaining them. With listeners,
+	 * a bulk operation therefore also costs O(k) for the k entries it moves.
+	 */
+	class Listener {
+	public:
+		virtual ~Listener() = default;
+		virtual void onInsert(const KeyType& key, ValueType value) = 0;
+		virtual void onUpdate(const KeyType& key, ValueType value) = 0;
+		virtual void onRemove(const KeyType& key) = 0;
+	};
+
+	void addListener(Listener* listener);
+	void removeListener(Listener* listener);
+
     private:
+	// subtrees smaller than this are never split between threads
+	static constexpr size_t PARALLEL_CUTOFF = 1 << 14;
+	static size_t getThreadCount(size_t threads);
+	// a suspended lookup of getBatch, defined in AVLTree.cpp
+	struct LookupTask;
+	// diff compares ranges with at most this many entries pair by pair
+	static constexpr size_t DIFF_CUTOFF = 32;
+	// dump hands its output to the stream in chunks of about this many bytes
+	static constexpr size_t DUMP_CHUNK = 1 << 16;
+	// the largest balance factor a node may have, 1 unless relaxed with AVLTREE_RELAXED_BALANCE
+#ifdef AVLTREE_RELAXED_BALANCE
+	static constexpr int MAX_IMBALANCE = AVLTREE_RELAXED_BALANCE;
+	static_assert(MAX_IMBALANCE >= 1, "AVLTREE_RELAXED_BALANCE must be at least 1");
+#else
+	static constexpr int MAX_IMBALANCE = 1;
+#endif
+	// tombstones purged by a lazy remove which finds too many of them
+	static constexpr size_t PURGE_STEP = 2;
+
+	// nodes are carved out of slabs of this many nodes, freed nodes are reused first
+	static constexpr size_t SLAB_NODES = 256;
+	struct NodePool {
+		struct Slab {
+			unique_ptr<byte[]> memory;
+			size_t capacity; // in nodes
+			size_t used; // nodes handed out from the end of the slab so far
+		};
+		mutex lock;
+		vector<Slab> slabs;
+		vector<AVLNode*> freeNodes; // only ever nodes of this pool's slabs
+		map<const byte*, const byte*> ranges; // the start and end of every slab, to find the pool of a node
+
+		void addSlab(size_t capacity, size_t used);
+		bool owns(const AVLNode* node) const;
+	};
+
+	// the distinct key prefixes of a prefix compressed tree, and how many nodes use each
+	struct PrefixPool {
+		char separator;
+		mutex lock;
+		unordered_map<KeyType, size_t> prefixes;
+	};
+
     AVLNode* root;
+	shared_ptr<PrefixPool> prefixPool; // nullptr unless keys are prefix compressed
+	shared_ptr<NodePool> nodePool; // shared with the trees this tree was split from or into
+	vector<shared_ptr<NodePool>> retainedPools; // the pools of nodes joined in from other trees
+	size_t rotations;
+	size_t version; // incremented by every insert and remove, used to invalidate fingers
+	bool lazyDeletion;
+	double compactionRatio; // the largest share of tombstones a lazy remove leaves in the tree
+	vector<Listener*> listeners;
+	uint64_t writeTimestamp; // the timestamp of the latest write, starting from 1
+	vector<AVLNode*> versionedNodes; // every node with a history
+	mutable mutex readerLock; // held while readers is changed
+	mutable mutex hashLock; // held while diff refreshes the hashes cached in the nodes
+	multiset<uint64_t> readers; // the timestamp of every active reader
+	atomic<uint64_t> newestReader; // the largest timestamp in readers, 0 if there are none
+	atomic<bool> versionsStale; // set when a reader ends, the next write collects versions
 	AVLNode* getRoot() const;
+	void destroyTree(size_t threads);
+	AVLNode* createNode(const KeyType& key, ValueType value, void* memory = nullptr);
+	void deleteNode(AVLNode* node);
+	void* allocateNode();
+	AVLNode* reserveNodes(size_t count);
+	ValueType update(const KeyType& key, ValueType value, bool relative);
+	bool sharesPools() const;
+	NodePool* findPool(const AVLNode* node) const;
+	void releaseNodes(const vector<AVLNode*>& nodes);
+	void beginWrite();
+	void reportBulk(AVLNode* current, bool added) const;
+	void recordVersion(AVLNode* node);
+	void dropVersions();
+	bool hasReaders() const;
+	static std::optional<ValueType> valueAt(const AVLNode* node, uint64_t timestamp);
+	void addMemoryUsage(AVLNode* current, MemoryUsage& usage) const;
+	void vanEmdeBoasOrder(AVLNode* current, size_t levels, vector<AVLNode*>& nodes) const;
+	void collectAtDepth(AVLNode* current, size_t depth, vector<AVLNode*>& nodes) const;
+	void storeKey(AVLNode* node, const KeyType& key);
+	void releasePrefix(AVLNode* node, PrefixPool* pool);
+	void adoptNodes(AVLNode* current, PrefixPool* from);
+	int compareKey(const KeyType& key, const AVLNode* node) const;
+	void seek(Finger& finger, const string& key) const;
+	bool advance(Finger& finger) const;
 	/* Methods for rebalancing */
 	void balanceNode(AVLNode*& node);
+#ifdef AVLTREE_RANK_BALANCED
+	void balanceRank(AVLNode*& node);
+	int getRank(AVLNode* node) const;
+#endif
 	void updateHeight(AVLNode*& node);
+	void updateCounts(AVLNode* node);
+	// what the parent of a subtree looks at when balancing, see retrace
+	struct Shape {
+		size_t height;
+		int rank; // 0 unless the tree is rank balanced
+		bool operator==(const Shape& other) const = default;
+	};
+	static Shape shapeOf(const AVLNode* node);
+	bool retrace(AVLNode*& node, const AVLNode* child, Shape before);
 	// void updateAllHeights();
 	int getBalanceFactor(AVLNode*& node);
 	AVLNode* rotateLeft(AVLNode*& node);
@@ -78,20 +392,104 @@ protected:
 
 	/* Recursive helper methods */
 	size_t height(AVLNode* current) const;
-	void printTree(ostream& os, AVLNode* current, size_t depth) const;
+	bool validateNode(AVLNode* current, const AVLNode* low, const AVLNode* high, size_t& height, size_t& count, size_t& tombstones) const;
 	bool insertNode(string& key, size_t value, AVLNode*& current);
-	bool remove(AVLNode*& current, KeyType key, size_t value);
+	bool findOrInsert(const KeyType& key, AVLNode*& current, AVLNode*& found);
+	bool remove(AVLNode*& current, const KeyType& key);
     bool removeNode(AVLNode*& current);
+	bool markDeleted(AVLNode* current, const KeyType& key);
+	bool purgeOne(AVLNode*& current);
+	AVLNode* detachMin(AVLNode*& current);
 	optional<size_t> get(const string& key, AVLNode* current) const;
-	void destroy(AVLNode*& current);
-	void createDeepCopy(AVLNode* current);
-	AVLNode* getNodeRef(const string& key, AVLNode* current);
-	vector<string> getAllKeys(AVLNode* current, vector<string>& keys) const;
+	LookupTask lookupGroup(const vector<KeyType>& keys, vector<std::optional<ValueType>>& results, size_t& next) const;
+	void destroy(AVLNode*& current, size_t threads, vector<AVLNode*>* freed);
+	AVLNode* createDeepCopy(AVLNode* current, size_t threads, AVLNode* slots);
+	AVLNode* buildFromEntries(const vector<pair<KeyType, ValueType>>& entries, size_t low, size_t high, size_t threads, AVLNode* slots);
+	void fillKeys(AVLNode* current, string* keys, size_t threads) const;
+	void fillEntries(AVLNode* current, pair<KeyType, ValueType>* entries, size_t threads) const;
+	AVLNode* getNodeRef(const string& key, AVLNode* current) const;
+	AVLNode* floorNode(AVLNode* current, const KeyType& key) const;
+	AVLNode* lastLive(AVLNode* current) const;
+	uint64_t subtreeHash(AVLNode* current) const;
+	void summarizeBelow(const KeyType& key, size_t& count, uint64_t& hash) const;
+	void summarizeRange(const KeyType& lowKey, const KeyType* highKey, size_t& count, uint64_t& hash) const;
+	void diffRange(const AVLTree& other, const KeyType& lowKey, const KeyType* highKey, vector<Difference>& differences) const;
+	// called by visitRange with every key-value pair visited, context is the function given to forEach
+	using Visit = void (*)(void* context, const KeyType& key, ValueType value);
+	void visitRange(AVLNode* current, const KeyType* lowKey, const KeyType* highKey, uint64_t timestamp, Visit visit, void* context, KeyType& scratch) const;
+	void getAllKeys(AVLNode* current, vector<string>& keys) const;
+	void getAllEntries(AVLNode* current, vector<pair<KeyType, ValueType>>& entries) const;
+	void scanRange(AVLNode* current, const string& lowKey, const string* highKey, vector<pair<KeyType, ValueType>>& entries) const;
+	void getAllNodes(AVLNode* current, vector<AVLNode*>& nodes) const;
+	AVLNode* buildBalanced(vector<AVLNode*>& nodes, size_t low, size_t high);
+	AVLNode* joinNodes(AVLNode* left, AVLNode* middle, AVLNode* right);
+	void splitNode(AVLNode* current, const string& key, AVLNode*& left, AVLNode*& right);
 	bool containsRecursive(AVLNode* current, const string& key) const;
-	vector<size_t> findRange(vector<size_t> range, size_t lowVal, size_t highVal, AVLNode* current) const;
+};
 
+/**
+ * Calls function with every key-value pair in key order, as function(const KeyType& key, ValueType value).
+ * No key is copied: function sees the key stored in the node, which it may also take as a string_view,
+ * and which is only valid during the call. Only a prefix compressed tree assembles its keys, in one
+ * buffer reused for every key. function must not change the tree.
+ * @param function the function called with each key-value pair
+ */
+template <typename Function>
+void AVLTree::forEach(Function&& function) const {
+	KeyType scratch;
+	visitRange(root, nullptr, nullptr, UINT64_MAX, [](void* context, const KeyType& key, ValueType value) {
+		(*static_cast<remove_reference_t<Function>*>(context))(key, value);
+	}, const_cast<void*>(static_cast<const void*>(addressof(function))), scratch);
+}
 
+/**
+ * Calls function with every key-value pair whose key is in [lowKey, highKey), in key order, like
+ * scanRange but without copying keys or building a vector, see forEach.
+ * @param lowKey the first key included
+ * @param highKey the first key not included
+ * @param function the function called with each key-value pair in the range
+ */
+template <typename Function>
+void AVLTree::forEachInRange(const string& lowKey, const string& highKey, Function&& function) const {
+	KeyType scratch;
+	visitRange(root, &lowKey, &highKey, UINT64_MAX, [](void* context, const KeyType& key, ValueType value) {
+		(*static_cast<remove_reference_t<Function>*>(context))(key, value);
+	}, const_cast<void*>(static_cast<const void*>(addressof(function))), scratch);
+}
 
-};
+/**
+ * writes every key in key order to an output iterator, like keys() without building a vector.
+ * @param out where the first key is written
+ * @return returns the iterator past the last key written.
+ */
+template <typename OutputIterator> requires output_iterator<OutputIterator, const AVLTree::KeyType&>
+OutputIterator AVLTree::keys(OutputIterator out) const {
+	forEach([&out](const KeyType& key, ValueType) {
+		*out++ = key;
+	});
+	return out;
+}
+
+/**
+ * writes every value between the values of lowKey and highKey to an output iterator, in key order,
+ * like findRange without building a vector.
+ * @param lowKey the key associated with a lower value
+ * @param highKey the key associated with a higher value
+ * @param out where the first value is written
+ * @return returns the iterator past the last value written.
+ */
+template <typename OutputIterator> requires output_iterator<OutputIterator, const AVLTree::ValueType&>
+OutputIterator AVLTree::findRange(const string& lowKey, const string& highKey, OutputIterator out) const {
+	std::optional<ValueType> lowVal = get(lowKey);
+	std::optional<ValueType> highVal = get(highKey);
+	if (lowVal.has_value() && highVal.has_value()) {
+		forEach([&out, low = lowVal.value(), high = highVal.value()](const KeyType&, ValueType value) {
+			if (value >= low && value <= high) {
+				*out++ = value;
+			}
+		});
+	}
+	return out;
+}
 
 #endif //AVLTREE_H
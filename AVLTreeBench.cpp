@@ -0,0 +1,685 @@
+/*
+Benchmark driver for the AVLTree.
+Built three times by CMake: AVLTreeBench uses the strict AVL policy,
+AVLTreeBenchRankBalanced is compiled with AVLTREE_RANK_BALANCED, and
+AVLTreeBenchRelaxed with AVLTREE_RELAXED_BALANCE=2, so the three
+balancing policies can be compared on the same workloads.
+
+usage: AVLTreeBench [treeSize] [operations]
+ */
+#include "AVLTree.h"
+#include "BlockAVLTree.h"
+#include "ReplicatedAVLTree.h"
+#include "WriteAheadLog.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef AVLTREE_LIBNUMA
+#include <numa.h>
+#endif
+using namespace std;
+
+#ifdef AVLTREE_RANK_BALANCED
+static const char* POLICY = "weak AVL";
+#elif defined(AVLTREE_RELAXED_BALANCE)
+#define AVLTREE_STRINGIFY(x) #x
+#define AVLTREE_POLICY_NAME(k) "AVL, imbalance up to " AVLTREE_STRINGIFY(k)
+static const char* POLICY = AVLTREE_POLICY_NAME(AVLTREE_RELAXED_BALANCE);
+#else
+static const char* POLICY = "AVL";
+#endif
+
+/**
+ * Fills a tree with treeSize random entries, then runs a delete heavy churn of 40% removes and
+ * 60% inserts against it, printing the rotations done and the throughput of the churn.
+ * @param treeSize the number of entries loaded before the churn starts
+ * @param operations the number of inserts and removes in the churn
+ */
+void deleteHeavyChurn(size_t treeSize, size_t operations) {
+	AVLTree tree;
+	mt19937_64 rng(42);
+	uniform_int_distribution<size_t> valueDist(0, treeSize * 4);
+	vector<size_t> live;
+
+	while (live.size() < treeSize) {
+		size_t value = valueDist(rng);
+		if (tree.insert(to_string(value), value)) {
+			live.push_back(value);
+		}
+	}
+	size_t rotationsBefore = tree.getRotationCount();
+
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < operations; i++) {
+		if (rng() % 10 < 4 && !live.empty()) {
+			// remove a random live entry
+			size_t index = rng() % live.size();
+			tree.remove(to_string(live[index]));
+			live[index] = live.back();
+			live.pop_back();
+		} else {
+			size_t value = valueDist(rng);
+			if (tree.insert(to_string(value), value)) {
+				live.push_back(value);
+			}
+		}
+	}
+	auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	size_t rotations = tree.getRotationCount() - rotationsBefore;
+	cout << "delete heavy churn (" << POLICY << ")" << endl;
+	cout << "  operations:      " << operations << endl;
+	cout << "  rotations:       " << rotations << endl;
+	cout << "  rotations/op:    " << static_cast<double>(rotations) / operations << endl;
+	cout << "  ops/sec:         " << operations / elapsed << endl;
+	cout << "  final height:    " << tree.getHeight() << endl;
+	cout << "  valid:           " << tree.validate() << endl;
+}
+
+/**
+ * Inserts operations keys into an empty tree in bursts, once in random order and once in sorted order,
+ * printing the rotations done, the insert throughput, and the height of the tree for both.
+ * @param operations the number of keys inserted
+ */
+void insertBurst(size_t operations) {
+	mt19937_64 rng(43);
+	vector<string> keys;
+	char buffer[32];
+	for (size_t i = 0; i < operations; i++) {
+		snprintf(buffer, sizeof(buffer), "%016zx", static_cast<size_t>(rng()));
+		keys.emplace_back(buffer);
+	}
+
+	cout << "insert burst (" << POLICY << ")" << endl;
+	for (bool sorted : {false, true}) {
+		if (sorted) {
+			sort(keys.begin(), keys.end());
+		}
+		AVLTree tree;
+		auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < keys.size(); i++) {
+			tree.insert(keys[i], i);
+		}
+		auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "  " << (sorted ? "sorted: " : "random: ") << static_cast<double>(tree.getRotationCount()) / operations
+			<< " rotations/insert, " << operations / elapsed << " inserts/sec, height " << tree.getHeight() << endl;
+	}
+}
+
+/**
+ * Inserts operations nearly sorted keys (increasing timestamps with a little jitter), once through
+ * plain insert and once through a single reused finger, printing the throughput of both.
+ * @param operations the number of keys inserted
+ */
+void sequentialIngest(size_t operations) {
+	// build the keys up front so both runs insert the same sequence
+	mt19937_64 rng(7);
+	vector<string> keys;
+	char buffer[32];
+	for (size_t i = 0; i < operations; i++) {
+		size_t timestamp = i * 8 + rng() % 16;
+		snprintf(buffer, sizeof(buffer), "%020zu", timestamp);
+		keys.emplace_back(buffer);
+	}
+
+	AVLTree plainTree;
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < keys.size(); i++) {
+		plainTree.insert(keys[i], i);
+	}
+	auto plainElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	AVLTree fingerTree;
+	AVLTree::Finger hint;
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < keys.size(); i++) {
+		fingerTree.insert(hint, keys[i], i);
+	}
+	auto fingerElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "sequential ingest (" << POLICY << ")" << endl;
+	cout << "  operations:      " << operations << endl;
+	cout << "  insert ops/sec:  " << operations / plainElapsed << endl;
+	cout << "  finger ops/sec:  " << operations / fingerElapsed << endl;
+	cout << "  valid:           " << (plainTree.validate() && fingerTree.validate()) << endl;
+}
+
+/**
+ * Loads a tree from operations sorted pairs, then exports and destroys it, once on a single thread
+ * and once on every hardware thread, printing the time each step took.
+ * @param operations the number of pairs loaded
+ */
+void bulkLoad(size_t operations) {
+	vector<pair<string, size_t>> entries;
+	char buffer[32];
+	for (size_t i = 0; i < operations; i++) {
+		snprintf(buffer, sizeof(buffer), "%020zu", i);
+		entries.emplace_back(buffer, i);
+	}
+
+	cout << "bulk load (" << POLICY << ")" << endl;
+	cout << "  entries:         " << operations << endl;
+	size_t hardwareThreads = thread::hardware_concurrency();
+	for (size_t threads : {size_t(1), hardwareThreads == 0 ? 1 : hardwareThreads}) {
+		AVLTree tree;
+		auto start = chrono::steady_clock::now();
+		tree.load(entries, threads);
+		auto loaded = chrono::steady_clock::now();
+		vector<string> keys = tree.keys(threads);
+		auto exported = chrono::steady_clock::now();
+		tree.clear(threads);
+		auto cleared = chrono::steady_clock::now();
+
+		cout << "  " << threads << " thread(s): load " << chrono::duration<double>(loaded - start).count()
+			<< "s, keys " << chrono::duration<double>(exported - loaded).count()
+			<< "s, clear " << chrono::duration<double>(cleared - exported).count() << "s" << endl;
+	}
+}
+
+/**
+ * Logs a tree of operations entries, checkpoints it, logs operations / 10 more updates, then times
+ * how long recovering the tree from the snapshot and log takes.
+ * @param operations the number of entries in the tree
+ */
+void recovery(size_t operations) {
+	string path = (filesystem::temp_directory_path() / "AVLTreeBench.log").string();
+	filesystem::remove(path);
+	filesystem::remove(path + ".snapshot");
+	char buffer[32];
+	{
+		AVLTree tree;
+		WriteAheadLog log(path);
+		log.open(tree);
+		AVLTree::Finger hint;
+		for (size_t i = 0; i < operations; i++) {
+			snprintf(buffer, sizeof(buffer), "%020zu", i);
+			tree.insert(hint, buffer, i);
+		}
+		log.checkpoint();
+		for (size_t i = 0; i < operations / 10; i++) {
+			snprintf(buffer, sizeof(buffer), "%020zu", i * 7 % operations);
+			tree[buffer] += 1;
+		}
+		log.sync();
+	}
+
+	AVLTree recovered;
+	WriteAheadLog log(path);
+	auto start = chrono::steady_clock::now();
+	log.open(recovered);
+	auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	log.close();
+	filesystem::remove(path);
+	filesystem::remove(path + ".snapshot");
+
+	cout << "recovery (" << POLICY << ")" << endl;
+	cout << "  entries:         " << recovered.size() << endl;
+	cout << "  seconds:         " << elapsed << endl;
+}
+
+/**
+ * Inserts operations keys sharing long prefixes (tenant/region/object/id) into a tree storing whole
+ * keys and into a prefix compressed tree, then times a prefix scan of every tenant in both.
+ * @param operations the number of keys inserted
+ */
+void prefixScan(size_t operations) {
+	const size_t tenants = 16;
+	cout << "prefix scan (" << POLICY << ")" << endl;
+	for (AVLTree::KeyStorage storage : {AVLTree::KeyStorage::Full, AVLTree::KeyStorage::PrefixCompressed}) {
+		AVLTree tree(storage);
+		char buffer[96];
+		for (size_t i = 0; i < operations; i++) {
+			snprintf(buffer, sizeof(buffer), "tenant-%04zu/region-eu-west-%zu/objects/%08zu", i % tenants, i % 3, i);
+			tree.insert(buffer, i);
+		}
+		auto start = chrono::steady_clock::now();
+		size_t found = 0;
+		for (size_t tenant = 0; tenant < tenants; tenant++) {
+			snprintf(buffer, sizeof(buffer), "tenant-%04zu/", tenant);
+			found += tree.scanPrefix(buffer).size();
+		}
+		auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "  " << (storage == AVLTree::KeyStorage::Full ? "full keys:       " : "prefix keys:     ")
+			<< found / elapsed << " keys/sec scanned" << endl;
+	}
+}
+
+/**
+ * Removes bursts of neighbouring keys from a tree of treeSize entries, once removing eagerly and once
+ * lazily, and prints the 99th percentile and worst latency of a single remove in both.
+ * @param treeSize the number of entries in the tree
+ * @param operations the number of removes, at most treeSize
+ */
+void burstyDeletes(size_t treeSize, size_t operations) {
+	operations = min(operations, treeSize);
+	if (operations == 0) {
+		return;
+	}
+	const size_t burst = 256;
+	cout << "bursty deletes (" << POLICY << ")" << endl;
+	for (bool lazy : {false, true}) {
+		vector<pair<string, size_t>> entries;
+		char buffer[32];
+		for (size_t i = 0; i < treeSize; i++) {
+			snprintf(buffer, sizeof(buffer), "%020zu", i);
+			entries.emplace_back(buffer, i);
+		}
+		AVLTree tree;
+		tree.load(entries);
+		tree.setLazyDeletion(lazy);
+
+		// remove runs of burst neighbouring keys, starting at random places
+		mt19937_64 rng(11);
+		vector<double> latencies;
+		latencies.reserve(operations);
+		while (latencies.size() < operations) {
+			size_t start = rng() % treeSize;
+			for (size_t i = start; i < start + burst && i < treeSize && latencies.size() < operations; i++) {
+				auto before = chrono::steady_clock::now();
+				tree.remove(entries[i].first);
+				latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - before).count());
+			}
+		}
+		sort(latencies.begin(), latencies.end());
+		cout << "  " << (lazy ? "lazy:  " : "eager: ") << "p99 " << latencies[latencies.size() * 99 / 100]
+			<< "us, max " << latencies.back() << "us, tombstones left " << tree.getTombstoneCount() << endl;
+	}
+}
+
+/**
+ * Looks up operations random keys in a tree of treeSize entries, once through get and once through
+ * getBatch with several group sizes, printing the throughput of each.
+ * @param treeSize the number of entries in the tree
+ * @param operations the number of lookups
+ */
+void batchedLookups(size_t treeSize, size_t operations) {
+	vector<pair<string, size_t>> entries;
+	char buffer[32];
+	for (size_t i = 0; i < treeSize; i++) {
+		snprintf(buffer, sizeof(buffer), "%012zu", i * 2);
+		entries.emplace_back(buffer, i);
+	}
+	AVLTree tree;
+	tree.load(entries);
+	// half the keys are missing
+	mt19937_64 rng(13);
+	vector<string> keys;
+	keys.reserve(operations);
+	for (size_t i = 0; i < operations; i++) {
+		snprintf(buffer, sizeof(buffer), "%012zu", static_cast<size_t>(rng() % (treeSize * 2 + 1)));
+		keys.emplace_back(buffer);
+	}
+
+	cout << "batched lookups (" << POLICY << ")" << endl;
+	size_t found = 0;
+	auto start = chrono::steady_clock::now();
+	for (const string& key : keys) {
+		found += tree.get(key).has_value();
+	}
+	auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << "  get:             " << operations / elapsed << " lookups/sec, " << found << " found" << endl;
+	for (size_t group : {1, 8, 16, 32}) {
+		start = chrono::steady_clock::now();
+		vector<std::optional<size_t>> values = tree.getBatch(keys, group);
+		elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		found = 0;
+		for (const std::optional<size_t>& value : values) {
+			found += value.has_value();
+		}
+		cout << "  getBatch(" << group << "):" << string(group < 10 ? 5 : 4, ' ') << operations / elapsed
+			<< " lookups/sec, " << found << " found" << endl;
+	}
+}
+
+/**
+ * Counts operations random keys out of treeSize distinct keys, once with a get followed by an insert or
+ * write, once with operator[], and once with increment, printing the throughput of each.
+ * @param treeSize the number of distinct keys
+ * @param operations the number of keys counted
+ */
+void counting(size_t treeSize, size_t operations) {
+	mt19937_64 rng(17);
+	vector<string> keys;
+	keys.reserve(operations);
+	for (size_t i = 0; i < operations; i++) {
+		keys.push_back(to_string(rng() % (treeSize + 1)));
+	}
+	cout << "counting (" << POLICY << ")" << endl;
+	for (const char* method : {"get + insert:    ", "operator[]:      ", "increment:       "}) {
+		AVLTree tree;
+		auto start = chrono::steady_clock::now();
+		for (const string& key : keys) {
+			if (method[0] == 'g') {
+				std::optional<size_t> count = tree.get(key);
+				if (!count.has_value()) {
+					tree.insert(key, 1);
+				} else {
+					tree[key] = count.value() + 1;
+				}
+			} else if (method[0] == 'o') {
+				tree[key] += 1;
+			} else {
+				tree.increment(key);
+			}
+		}
+		auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "  " << method << operations / elapsed << " ops/sec" << endl;
+	}
+}
+
+/**
+ * Copies a tree of treeSize entries, changes 100 entries of the copy, then times finding the changes
+ * with diff and by comparing the entries of both trees, printing both times.
+ * @param treeSize the number of entries in the tree
+ */
+void treeDiff(size_t treeSize) {
+	AVLTree yesterday;
+	mt19937_64 rng(19);
+	for (size_t i = 0; i < treeSize; i++) {
+		yesterday.insert(to_string(rng()), i);
+	}
+	AVLTree today(yesterday);
+	// the first diff computes every cached hash, later diffs only refresh the changed paths
+	yesterday.diff(today);
+	for (size_t i = 0; i < 100; i++) {
+		today.increment(to_string(rng() % 1000));
+	}
+
+	auto start = chrono::steady_clock::now();
+	size_t found = yesterday.diff(today).size();
+	auto diffElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	start = chrono::steady_clock::now();
+	vector<pair<string, size_t>> before = yesterday.entries();
+	vector<pair<string, size_t>> after = today.entries();
+	size_t compared = 0;
+	size_t i = 0, j = 0;
+	while (i < before.size() || j < after.size()) {
+		if (j == after.size() || (i < before.size() && before[i].first < after[j].first)) {
+			compared++;
+			i++;
+		} else if (i == before.size() || after[j].first < before[i].first) {
+			compared++;
+			j++;
+		} else {
+			compared += before[i++].second != after[j++].second;
+		}
+	}
+	auto scanElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "tree diff (" << POLICY << ")" << endl;
+	cout << "  differences:     " << found << " (" << compared << " by full compare)" << endl;
+	cout << "  diff:            " << diffElapsed << "s" << endl;
+	cout << "  full compare:    " << scanElapsed << "s" << endl;
+}
+
+/**
+ * Inserts operations random keys, removes 90% of them, then prints the memory used and the time of a
+ * full scan and of treeSize lookups before and after compacting the tree in each node order.
+ * @param treeSize the number of lookups timed
+ * @param operations the number of keys inserted
+ */
+void memoryCompaction(size_t treeSize, size_t operations) {
+	cout << "memory compaction (" << POLICY << ")" << endl;
+	for (AVLTree::NodeOrder order : {AVLTree::NodeOrder::InOrder, AVLTree::NodeOrder::VanEmdeBoas}) {
+		AVLTree tree;
+		mt19937_64 rng(23);
+		vector<string> keys;
+		for (size_t i = 0; i < operations; i++) {
+			keys.push_back(to_string(rng()));
+			tree.insert(keys.back(), i);
+		}
+		for (size_t i = 0; i < operations; i++) {
+			if (i % 10 != 0) {
+				tree.remove(keys[i]);
+			}
+		}
+		for (bool compacted : {false, true}) {
+			if (compacted) {
+				tree.compact(order);
+			}
+			AVLTree::MemoryUsage usage = tree.memoryUsage();
+			auto start = chrono::steady_clock::now();
+			size_t scanned = tree.entries().size();
+			auto scanElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			start = chrono::steady_clock::now();
+			size_t found = 0;
+			for (size_t i = 0; i < treeSize; i++) {
+				found += tree.contains(keys[rng() % operations]);
+			}
+			auto lookupElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			cout << "  " << (!compacted ? "before:          " : order == AVLTree::NodeOrder::InOrder ? "in order:        " : "van Emde Boas:   ")
+				<< usage.totalBytes << " bytes (" << usage.slackBytes << " slack), scan of " << scanned << " "
+				<< scanElapsed << "s, " << found << " lookups " << lookupElapsed << "s" << endl;
+		}
+	}
+}
+
+/**
+ * Inserts operations random keys into an AVLTree and a BlockAVLTree, then times a full scan, treeSize
+ * range scans of about 100 keys, and treeSize lookups in both, printing the throughput of each.
+ * @param treeSize the number of range scans and lookups
+ * @param operations the number of keys inserted
+ */
+void blockScan(size_t treeSize, size_t operations) {
+	AVLTree nodeTree;
+	BlockAVLTree blockTree;
+	mt19937_64 rng(29);
+	vector<string> keys;
+	char buffer[32];
+	for (size_t i = 0; i < operations; i++) {
+		snprintf(buffer, sizeof(buffer), "%012zu", static_cast<size_t>(rng() % 1000000000000));
+		keys.emplace_back(buffer);
+		nodeTree.insert(keys.back(), i);
+		blockTree.insert(keys.back(), i);
+	}
+	// a range covering about 100 keys
+	size_t width = 1000000000000 / max<size_t>(operations, 1) * 100;
+
+	cout << "block scan (" << POLICY << ")" << endl;
+	for (bool blocks : {false, true}) {
+		auto start = chrono::steady_clock::now();
+		size_t scanned = blocks ? blockTree.entries().size() : nodeTree.entries().size();
+		auto scanElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		mt19937_64 queries(31);
+		size_t ranged = 0;
+		start = chrono::steady_clock::now();
+		for (size_t i = 0; i < treeSize; i++) {
+			size_t low = queries() % 1000000000000;
+			snprintf(buffer, sizeof(buffer), "%012zu", low);
+			string lowKey = buffer;
+			snprintf(buffer, sizeof(buffer), "%012zu", low + width);
+			ranged += blocks ? blockTree.scanRange(lowKey, buffer).size() : nodeTree.scanRange(lowKey, buffer).size();
+		}
+		auto rangeElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		size_t found = 0;
+		start = chrono::steady_clock::now();
+		for (size_t i = 0; i < treeSize; i++) {
+			const string& key = keys[queries() % keys.size()];
+			found += blocks ? blockTree.contains(key) : nodeTree.contains(key);
+		}
+		auto lookupElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		cout << "  " << (blocks ? "blocks: " : "nodes:  ") << scanned / scanElapsed << " scanned/sec, "
+			<< ranged / rangeElapsed << " ranged/sec, " << found / lookupElapsed << " lookups/sec" << endl;
+	}
+}
+
+/**
+ * Exports a tree of treeSize entries a few times, once by copying it out with entries(), once into
+ * a reused keys buffer, and once by visiting it with forEach, printing the entries exported per second.
+ * @param treeSize the number of entries in the tree
+ */
+void exportScan(size_t treeSize) {
+	AVLTree tree;
+	mt19937_64 rng(37);
+	char buffer[48];
+	for (size_t i = 0; i < treeSize; i++) {
+		// keys too long for the inline string storage, so every copy allocates
+		snprintf(buffer, sizeof(buffer), "customer/%08zu/order/%012zu", static_cast<size_t>(rng() % 100000), i);
+		tree.insert(buffer, i);
+	}
+	const size_t rounds = 5;
+
+	cout << "export (" << POLICY << ")" << endl;
+	size_t copied = 0;
+	auto start = chrono::steady_clock::now();
+	for (size_t round = 0; round < rounds; round++) {
+		copied += tree.entries().size();
+	}
+	auto copyElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	vector<string> keys;
+	size_t buffered = 0;
+	start = chrono::steady_clock::now();
+	for (size_t round = 0; round < rounds; round++) {
+		tree.keys(keys);
+		buffered += keys.size();
+	}
+	auto bufferElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	size_t visited = 0;
+	size_t bytes = 0;
+	start = chrono::steady_clock::now();
+	for (size_t round = 0; round < rounds; round++) {
+		tree.forEach([&visited, &bytes](string_view key, size_t) {
+			visited++;
+			bytes += key.size();
+		});
+	}
+	auto visitElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "  entries(): " << copied / copyElapsed << " entries/sec, reused keys buffer: "
+		<< buffered / bufferElapsed << " entries/sec, forEach: " << visited / visitElapsed << " entries/sec, "
+		<< bytes / rounds << " key bytes" << endl;
+}
+
+/**
+ * Dumps a tree of operations entries to a file in each format, printing the nodes written per second.
+ * @param operations the number of entries in the tree
+ */
+void treeDump(size_t operations) {
+	AVLTree tree;
+	mt19937_64 rng(41);
+	char buffer[32];
+	for (size_t i = 0; i < operations; i++) {
+		snprintf(buffer, sizeof(buffer), "%012zu", static_cast<size_t>(rng() % 1000000000000));
+		tree.insert(buffer, i);
+	}
+	string path = (filesystem::temp_directory_path() / "AVLTreeBench.dump").string();
+
+	cout << "dump (" << POLICY << ")" << endl;
+	const pair<AVLTree::DumpFormat, const char*> formats[] = {
+		{AVLTree::DumpFormat::Text, "text"}, {AVLTree::DumpFormat::Dot, "dot"}, {AVLTree::DumpFormat::JsonLines, "json lines"}
+	};
+	for (const auto& [format, name] : formats) {
+		ofstream out(path, ios::trunc);
+		auto start = chrono::steady_clock::now();
+		size_t written = tree.dump(out, format);
+		out.close();
+		auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "  " << name << ": " << written / elapsed << " nodes/sec, " << filesystem::file_size(path) << " bytes" << endl;
+	}
+	filesystem::remove(path);
+}
+
+/**
+ * Replicates a tree of treeSize entries to one replica per NUMA node, at least two, then runs one
+ * reader thread per replica, once with every thread reading its local replica, the one get picks for
+ * it, and once with every thread reading replica 0, printing the replication and lookup throughput.
+ * With libnuma the readers are spread over the nodes first. On a single socket the two lookup figures
+ * are close; across sockets the first avoids remote memory.
+ * @param treeSize the number of entries replicated
+ * @param operations the number of lookups, split over the threads
+ */
+void replicatedLookups(size_t treeSize, size_t operations) {
+	ReplicatedAVLTree tree(max<size_t>(ReplicatedAVLTree::getNodeCount(), 2));
+	size_t replicas = tree.getReplicaCount();
+	char buffer[32];
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < treeSize; i++) {
+		snprintf(buffer, sizeof(buffer), "%012zu", i * 2);
+		tree.insert(buffer, i);
+	}
+	tree.sync();
+	auto replicateElapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "replicated lookups (" << POLICY << ", " << replicas << " replicas on "
+		<< ReplicatedAVLTree::getNodeCount() << " nodes)" << endl;
+	cout << "  replicated:    " << treeSize / replicateElapsed << " inserts/sec" << endl;
+	for (bool local : {true, false}) {
+		vector<thread> readers;
+		vector<size_t> found(replicas);
+		start = chrono::steady_clock::now();
+		for (size_t reader = 0; reader < replicas; reader++) {
+			readers.emplace_back([&tree, &found, reader, local, replicas, treeSize, operations] {
+#ifdef AVLTREE_LIBNUMA
+				// run next to a replica, so getLocalReplica picks the replica of the reader's node
+				if (numa_available() >= 0) {
+					numa_run_on_node(static_cast<int>(reader % ReplicatedAVLTree::getNodeCount()));
+				}
+#endif
+				// half the keys are missing
+				mt19937_64 rng(43 + reader);
+				char key[32];
+				// counted locally and stored once, so readers do not share the cache line of found
+				size_t count = 0;
+				for (size_t i = 0; i < operations / replicas; i++) {
+					snprintf(key, sizeof(key), "%012zu", static_cast<size_t>(rng() % (treeSize * 2 + 1)));
+					count += (local ? tree.get(key) : tree.get(key, 0)).has_value();
+				}
+				found[reader] = count;
+			});
+		}
+		for (thread& reader : readers) {
+			reader.join();
+		}
+		auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		size_t total = 0;
+		for (size_t count : found) {
+			total += count;
+		}
+		cout << (local ? "  own replica:   " : "  replica 0:     ") << operations / elapsed << " lookups/sec, "
+			<< total << " found" << endl;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	size_t treeSize = 100000;
+	size_t operations = 1000000;
+	if (argc > 1) {
+		treeSize = strtoull(argv[1], nullptr, 10);
+	}
+	if (argc > 2) {
+		operations = strtoull(argv[2], nullptr, 10);
+	}
+
+	deleteHeavyChurn(treeSize, operations);
+	insertBurst(operations);
+	sequentialIngest(operations);
+	bulkLoad(operations);
+	recovery(operations);
+	prefixScan(operations);
+	burstyDeletes(treeSize, operations);
+	batchedLookups(treeSize, operations);
+	counting(treeSize, operations);
+	treeDiff(treeSize);
+	memoryCompaction(treeSize, operations);
+	blockScan(treeSize, operations);
+	exportScan(treeSize);
+	treeDump(operations);
+	replicatedLookups(treeSize, operations);
+	return 0;
+}
@@ -10,6 +10,10 @@ instead for you to get an idea of how to test the tree
 #include <vector>
 using namespace std;
 #include "AVLTree.h"
+#include "AVLCache.h"
+#include "ChangeStream.h"
+#include "ReplicatedAVLTree.h"
+#include "ShardedAVLTree.h"
 #include <iostream>
 
 
@@ -51,6 +55,11 @@ int main() {
     cout << endl << endl;
     cout << tree << endl;
 
+    // the same tree for Graphviz and for tools, the JSON cut off after two levels
+    tree.dump(cout, AVLTree::DumpFormat::Dot);
+    tree.dump(cout, AVLTree::DumpFormat::JsonLines, 1);
+    cout << endl;
+
     insertResult = tree.insert("V", 22);
     insertResult = tree.insert("A", 1); // false, duplicate
     insertResult = tree.insert("Z", 26);
@@ -62,6 +71,7 @@ int main() {
 	// size and getHeight
     cout << "tree size: " << tree.size() << endl; // 10
     cout << "tree height: " << tree.getHeight() << endl; // 3
+    cout << "tree valid: " << tree.validate() << endl; // 1
     cout << endl;
 
     // contains
@@ -118,5 +128,76 @@ int main() {
     cout << endl << endl;
     cout << tree << endl;
 
+    // sharded trees
+    ShardedAVLTree hashed(4);
+    ShardedAVLTree ranged(vector<string>{"H", "P"});
+    for (char c = 'A'; c <= 'Z'; c++) {
+        hashed.insert(string(1, c), c - 'A' + 1);
+        ranged.insert(string(1, c), c - 'A' + 1);
+    }
+    cout << "hashed keys: ";
+    for (const string& key : hashed.keys()) { // A through Z
+        cout << key << " ";
+    }
+    cout << endl;
+    cout << "ranged split: " << ranged.splitShard(2) << endl; // 1
+    cout << "ranged merge: " << ranged.mergeShards(0) << endl; // 1
+    cout << "ranged shards: " << ranged.getShardCount() << endl; // 3
+    cout << "ranged findRange(C, F): ";
+    for (size_t val : ranged.findRange("C", "F")) { // 3 4 5 6
+        cout << val << " ";
+    }
+    cout << endl;
+
+    // bounded cache
+    AVLCache cache(3);
+    cache.put("A", 1);
+    cache.put("B", 2);
+    cache.put("C", 3);
+    cache.get("A"); // A becomes the most recently used
+    cache.put("D", 4); // evicts B
+    cout << "cache by recency: ";
+    for (const string& key : cache.keysByRecency()) { // D A C
+        cout << key << " ";
+    }
+    cout << endl;
+    cout << "cache get(B): " << cache.get("B").has_value() << endl; // 0
+    AVLCache::Statistics statistics = cache.getStatistics();
+    cout << "cache hits/misses/evictions: " << statistics.hits << "/" << statistics.misses << "/"
+        << statistics.evictions << endl; // 1/1/1
+
+    // change stream feeding a replica
+    AVLTree primary;
+    AVLTree replica;
+    ChangeStream stream;
+    primary.addListener(&stream);
+    size_t subscriber = stream.subscribe().value();
+    primary.insert("A", 1);
+    primary.insert("B", 2);
+    primary["A"] = 3;
+    primary.remove("B");
+    vector<ChangeStream::Event> events;
+    stream.poll(subscriber, events);
+    for (const ChangeStream::Event& event : events) {
+        if (event.change == ChangeStream::Change::Remove) {
+            replica.remove(event.key);
+        } else if (!replica.insert(event.key, event.value)) {
+            replica[event.key] = event.value;
+        }
+    }
+    primary.removeListener(&stream);
+    cout << "stream events: " << events.size() << endl; // 4
+    cout << replica << endl; // {A: 3}
+
+    // read replicas, two simulated nodes
+    ReplicatedAVLTree replicated(2);
+    replicated.insert("A", 1);
+    replicated.insert("B", 2);
+    replicated.increment("A", 2);
+    replicated.remove("B");
+    replicated.sync();
+    cout << "replica 0 get(A): " << replicated.get("A", 0).value() << endl; // 3
+    cout << "replica 1 contains(B): " << replicated.contains("B", 1) << endl; // 0
+
     return 0;
 }
@@ -0,0 +1,655 @@
+/*
+Differential stress driver for the AVLTree.
+Runs a long random sequence of operations against both an AVLTree and a
+std::map, checking every result against the map and every AVL invariant
+with validate() along the way, and times every kind of operation.
+
+usage: AVLTreeStress [--write-baseline] [operations] [seed] [baselineFile] [tolerance]
+
+Given baselineFile, the run fails when any operation is more than
+tolerance (default 0.25, i.e. 25%) slower per call than the baseline, or
+when the file is missing or malformed. Operations called fewer than
+MIN_GATED_CALLS times in either run are reported but not gated, their
+timings are too noisy. With --write-baseline, the timings of this run are
+written to baselineFile instead. Only the calls to the tree are timed.
+Before the stress run, a tree recovered from a WriteAheadLog is checked
+against the tree which wrote the log, see checkRecovery, and a BlockAVLTree
+gets its own run against a std::map, see checkBlockTree.
+The exit code is 0 when every check passed, and 1 otherwise.
+
+Compiled with AVLTREE_LIBFUZZER, the same checks run on byte strings from
+libFuzzer instead, see LLVMFuzzerTestOneInput.
+ */
+#include "AVLTree.h"
+#include "BlockAVLTree.h"
+#include "ChangeStream.h"
+#include "WriteAheadLog.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+using namespace std;
+
+// operations called fewer times than this are not held to the baseline
+static const size_t MIN_GATED_CALLS = 5000;
+
+// the kinds of operation, each timed separately
+enum Operation {
+	INSERT, REMOVE, GET, CONTAINS, SUBSCRIPT, INCREMENT, AT, FINGER_INSERT, LOWER_BOUND,
+	SCAN_RANGE, KEY_AT, FLOOR, SPLIT_JOIN, COPY, LAZY, COMPACT, DIFF, SNAPSHOT, READ_AT, POOL_SHARE, REFERENCE_DIFF, REFERENCE_READ, OPERATION_COUNT
+};
+
+static const char* OPERATION_NAMES[OPERATION_COUNT] = {
+	"insert", "remove", "get", "contains", "operator[]", "increment", "at", "finger insert", "lowerBoundFrom",
+	"scanRange", "keyAt", "floorEntry", "split/join", "copy", "lazy toggle", "compact", "diff", "snapshot", "read at", "pool sharing", "reference diff",
+	"reference read"
+};
+
+/**
+ * An AVLTree and a std::map which receive the same operations. Every operation checks the
+ * tree's answer against the map's, and only its calls to the tree are timed, see timed.
+ * A snapshot keeps a copy of the map next to a read timestamp of the tree, and reads at that
+ * timestamp are checked against the copy however the tree changed since. A follower thread replays
+ * the tree's ChangeStream into a mirror tree, the way a replica follows its primary, and check
+ * compares the mirror with the tree, so every change must reach the listeners.
+ */
+class StressRun {
+public:
+	double seconds[OPERATION_COUNT] = {};
+	size_t calls[OPERATION_COUNT] = {};
+
+	StressRun() : subscriber(stream.subscribe().value()), applied(0), stopping(false) {
+		tree.addListener(&stream);
+		follower = thread(&StressRun::follow, this);
+	}
+
+	~StressRun() {
+		stopping.store(true, memory_order_release);
+		follower.join();
+		tree.removeListener(&stream);
+	}
+
+	/**
+	 * Applies one operation to both containers and checks the results agree.
+	 * @param operation the kind of operation, taken modulo OPERATION_COUNT
+	 * @param key the key the operation is about
+	 * @param value the value the operation writes, if any
+	 * @return returns true if the tree agreed with the map, returns false and prints why otherwise.
+	 */
+	bool apply(size_t operation, const string& key, size_t value) {
+		operation %= OPERATION_COUNT;
+		elapsed = 0;
+		bool agreed = true;
+		switch (operation) {
+		case INSERT:
+			agreed = timed([&] { return tree.insert(key, value); }) == reference.emplace(key, value).second;
+			break;
+		case REMOVE:
+			agreed = timed([&] { return tree.remove(key); }) == (reference.erase(key) == 1);
+			break;
+		case GET: {
+			auto found = reference.find(key);
+			agreed = timed([&] { return tree.get(key); }) == (found == reference.end() ? nullopt : std::optional<size_t>(found->second));
+			break;
+		}
+		case CONTAINS:
+			agreed = timed([&] { return tree.contains(key); }) == (reference.count(key) == 1);
+			break;
+		case SUBSCRIPT:
+			timed([&] { tree[key] += value; });
+			reference[key] += value;
+			agreed = tree.get(key) == reference[key];
+			break;
+		case INCREMENT:
+			agreed = timed([&] { return tree.increment(key, value); }) == (reference[key] += value);
+			break;
+		case AT: {
+			bool present = reference.count(key) == 1;
+			try {
+				timed([&] { tree.at(key) = value; });
+				agreed = present;
+				reference[key] = value;
+			} catch (const out_of_range&) {
+				agreed = !present;
+			}
+			break;
+		}
+		case FINGER_INSERT:
+			agreed = timed([&] { return tree.insert(finger, key, value); }) == reference.emplace(key, value).second;
+			break;
+		case LOWER_BOUND: {
+			auto found = reference.lower_bound(key);
+			bool exists = timed([&] { return tree.lowerBoundFrom(finger, key); });
+			agreed = exists == (found != reference.end()) && (!exists || finger.key() == found->first);
+			break;
+		}
+		case SCAN_RANGE: {
+			string highKey = key + "~";
+			vector<pair<string, size_t>> expected(reference.lower_bound(key), reference.lower_bound(highKey));
+			agreed = timed([&] { return tree.scanRange(key, highKey); }) == expected;
+			break;
+		}
+		case KEY_AT: {
+			size_t index = value % (reference.size() + 1);
+			auto found = reference.begin();
+			advance(found, index);
+			agreed = timed([&] { return tree.keyAt(index); }) == (found == reference.end() ? nullopt : std::optional<string>(found->first));
+			break;
+		}
+		case FLOOR: {
+			auto found = reference.upper_bound(key);
+			std::optional<pair<string, size_t>> floor = timed([&] { return tree.floorEntry(key); });
+			agreed = found == reference.begin() ? !floor.has_value() : floor == pair<string, size_t>(*prev(found));
+			break;
+		}
+		case SPLIT_JOIN: {
+			// split and join do not move versions, so they refuse while the snapshot is open
+			AVLTree upper;
+			if (snapshot.has_value()) {
+				agreed = timed([&] { return !tree.split(key, upper) && !tree.join(upper); });
+			} else {
+				agreed = timed([&] { return tree.split(key, upper) && tree.join(upper); }) && upper.size() == 0;
+			}
+			break;
+		}
+		case COPY: {
+			AVLTree assigned;
+			assigned.insert(key, value);
+			timed([&] {
+				AVLTree copy(tree);
+				assigned = copy;
+			});
+			agreed = assigned.size() == reference.size() && assigned.validate() && assigned.diff(tree).empty();
+			break;
+		}
+		case LAZY:
+			timed([&] { tree.setLazyDeletion(value % 2 == 0); });
+			break;
+		case COMPACT:
+			timed([&] { tree.compact(value % 2 == 0 ? AVLTree::NodeOrder::InOrder : AVLTree::NodeOrder::VanEmdeBoas); });
+			break;
+		case DIFF: {
+			AVLTree other(tree);
+			other.increment(key, 1);
+			vector<AVLTree::Difference> differences = timed([&] { return tree.diff(other); });
+			agreed = differences.size() == 1 && differences[0].key == key;
+			break;
+		}
+		case SNAPSHOT:
+			if (snapshot.has_value()) {
+				// check the whole snapshot once before ending it
+				vector<pair<string, size_t>> expected(snapshot->second.begin(), snapshot->second.end());
+				agreed = timed([&] { return tree.scanRange("", "~", snapshot->first); }) == expected;
+				timed([&] { tree.endRead(snapshot->first); });
+				snapshot.reset();
+			} else {
+				snapshot.emplace(timed([&] { return tree.beginRead(); }), reference);
+			}
+			break;
+		case READ_AT:
+			if (snapshot.has_value()) {
+				auto found = snapshot->second.find(key);
+				agreed = timed([&] { return tree.get(key, snapshot->first); }) ==
+					(found == snapshot->second.end() ? nullopt : std::optional<size_t>(found->second));
+			}
+			break;
+		case POOL_SHARE: {
+			// upper shares the node pool of a copy which joins a third tree and is destroyed, then
+			// reuses the nodes the copy freed, none of which may come from the third tree's pool
+			AVLTree upper;
+			{
+				AVLTree lower(tree);
+				AVLTree joined;
+				joined.insert(key, value);
+				agreed = timed([&] { return lower.split(key, upper) && lower.join(joined); });
+			}
+			map<string, size_t> expected(reference.lower_bound(key), reference.end());
+			// enough inserts to use up every node the copy freed
+			size_t freed = reference.size() - expected.size() + 1;
+			for (size_t i = 0; i <= freed; i++) {
+				string inserted = key + "/" + to_string(i);
+				agreed = agreed && timed([&] { return upper.insert(inserted, i); }) == expected.emplace(inserted, i).second;
+			}
+			agreed = agreed && upper.validate() && upper.entries() == vector<pair<string, size_t>>(expected.begin(), expected.end());
+			break;
+		}
+		case REFERENCE_DIFF: {
+			// writes through two references after a diff, the older one first, must show up in the next diffs
+			string newerKey = key + "/";
+			AVLTree::ValueReference older = timed([&] { return tree[key]; });
+			AVLTree::ValueReference newer = timed([&] { return tree[newerKey]; });
+			reference[key];
+			reference[newerKey];
+			AVLTree other(tree);
+			agreed = timed([&] { return tree.diff(other); }).empty();
+			timed([&] { older += value + 1; });
+			reference[key] += value + 1;
+			vector<AVLTree::Difference> differences = timed([&] { return tree.diff(other); });
+			agreed = agreed && differences.size() == 1 && differences[0].key == key && differences[0].before == reference[key];
+			timed([&] { newer += value + 2; });
+			reference[newerKey] += value + 2;
+			differences = timed([&] { return tree.diff(other); });
+			agreed = agreed && differences.size() == 2 && differences[1].key == newerKey && differences[1].before == reference[newerKey];
+			break;
+		}
+		case REFERENCE_READ: {
+			// writes through two references handed out before beginRead, the older one first, must
+			// not show up at the read's timestamp
+			string newerKey = key + "/";
+			AVLTree::ValueReference older = timed([&] { return tree[key]; });
+			AVLTree::ValueReference newer = timed([&] { return tree[newerKey]; });
+			size_t before = reference[key];
+			size_t newerBefore = reference[newerKey];
+			uint64_t timestamp = timed([&] { return tree.beginRead(); });
+			timed([&] {
+				older += value + 1;
+				newer += value + 2;
+			});
+			reference[key] += value + 1;
+			reference[newerKey] += value + 2;
+			agreed = tree.get(key, timestamp) == before && tree.get(newerKey, timestamp) == newerBefore &&
+				tree.get(key) == reference[key] && tree.get(newerKey) == reference[newerKey];
+			timed([&] { tree.endRead(timestamp); });
+			break;
+		}
+		}
+		seconds[operation] += elapsed;
+		calls[operation]++;
+		if (!agreed) {
+			cerr << "mismatch: " << OPERATION_NAMES[operation] << "(" << key << ", " << value << ")" << endl;
+		}
+		return agreed;
+	}
+
+	/**
+	 * Checks every AVL invariant and that the tree holds exactly the pairs of the map.
+	 * @return returns true if the tree is valid and equal to the map, returns false and prints why otherwise.
+	 */
+	bool check() {
+		if (!tree.validate()) {
+			cerr << "invariant broken" << endl;
+			return false;
+		}
+		if (tree.size() != reference.size() || tree.entries() != vector<pair<string, size_t>>(reference.begin(), reference.end())) {
+			cerr << "contents differ, size " << tree.size() << " expected " << reference.size() << endl;
+			return false;
+		}
+		// the follower only touches the mirror while it has events left to apply
+		while (applied.load(memory_order_acquire) < stream.getPublished()) {
+			this_thread::yield();
+		}
+		if (mirror.entries() != tree.entries()) {
+			cerr << "change stream mirror differs, size " << mirror.size() << " expected " << tree.size() << endl;
+			return false;
+		}
+		return true;
+	}
+
+private:
+	AVLTree tree;
+	ChangeStream stream;
+	size_t subscriber;
+	AVLTree mirror; // written only by the follower
+	atomic<uint64_t> applied; // the number of events of stream applied to mirror
+	atomic<bool> stopping;
+	thread follower;
+	map<string, size_t> reference;
+	AVLTree::Finger finger;
+	// a read timestamp of the tree, and the contents of the map at that time
+	std::optional<pair<uint64_t, map<string, size_t>>> snapshot;
+	double elapsed; // the seconds spent in tree calls by the current operation
+
+	/**
+	 * makes a tree call, adding the time it took to elapsed. Only the tree calls of an operation are
+	 * timed, not the work on the map checking them.
+	 * @param call the tree call
+	 * @return returns what call returned.
+	 */
+	template <typename Call>
+	invoke_result_t<Call> timed(Call&& call) {
+		auto start = chrono::steady_clock::now();
+		if constexpr (is_void_v<invoke_result_t<Call>>) {
+			call();
+			elapsed += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		} else {
+			auto result = call();
+			elapsed += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			return result;
+		}
+	}
+
+	/**
+	 * the loop of the follower thread: applies the events of stream to mirror until the run ends.
+	 */
+	void follow() {
+		vector<ChangeStream::Event> batch;
+		size_t idle = 0;
+		while (!stopping.load(memory_order_acquire)) {
+			batch.clear();
+			if (stream.poll(subscriber, batch, 256) == 0) {
+				// back off, so an idle follower does not take time from the timed operations
+				if (++idle < 64) {
+					this_thread::yield();
+				} else {
+					this_thread::sleep_for(chrono::microseconds(50));
+				}
+				continue;
+			}
+			idle = 0;
+			for (const ChangeStream::Event& event : batch) {
+				if (event.change == ChangeStream::Change::Remove) {
+					mirror.remove(event.key);
+				} else if (!mirror.insert(event.key, event.value)) {
+					mirror[event.key] = event.value;
+				}
+			}
+			applied.store(batch.back().sequence + 1, memory_order_release);
+		}
+	}
+};
+
+#ifdef AVLTREE_LIBFUZZER
+/**
+ * libFuzzer entry point. Every 3 bytes of data are one operation: its kind, its key, and its value.
+ * Aborts when the tree disagrees with std::map.
+ */
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	StressRun run;
+	for (size_t i = 0; i + 3 <= size; i += 3) {
+		if (!run.apply(data[i], to_string(data[i + 1]), data[i + 2])) {
+			abort();
+		}
+	}
+	if (!run.check()) {
+		abort();
+	}
+	return 0;
+}
+#else
+/**
+ * Writes the nanoseconds per call of this run to a baseline file, one line per operation called:
+ * the operation number, its nanoseconds per call, and its number of calls.
+ * @param run the finished run
+ * @param path the baseline file, overwritten if it exists
+ * @return returns true if the file was written.
+ */
+bool writeBaseline(const StressRun& run, const string& path) {
+	ofstream out(path);
+	for (size_t i = 0; i < OPERATION_COUNT; i++) {
+		if (run.calls[i] > 0) {
+			out << i << " " << run.seconds[i] * 1e9 / run.calls[i] << " " << run.calls[i] << "\n";
+		}
+	}
+	out.close();
+	if (!out) {
+		cerr << "baseline: cannot write " << path << endl;
+		return false;
+	}
+	cout << "baseline written to " << path << endl;
+	return true;
+}
+
+/**
+ * Compares the nanoseconds per call of this run with a baseline file written by writeBaseline.
+ * Operations with fewer than MIN_GATED_CALLS calls in either run are skipped.
+ * @param run the finished run
+ * @param path the baseline file
+ * @param tolerance how much slower than the baseline an operation may be, 0.25 for 25%
+ * @return returns true if no operation regressed past tolerance, returns false if one did or the
+ * file is missing, empty or has a malformed line.
+ */
+bool checkBaseline(const StressRun& run, const string& path, double tolerance) {
+	ifstream in(path);
+	if (!in) {
+		cerr << "baseline: cannot read " << path << ", write it with --write-baseline" << endl;
+		return false;
+	}
+	bool passed = true;
+	size_t lines = 0;
+	string line;
+	while (getline(in, line)) {
+		lines++;
+		istringstream fields(line);
+		size_t operation;
+		double baseline;
+		size_t baselineCalls;
+		string rest;
+		if (!(fields >> operation >> baseline >> baselineCalls) || fields >> rest || operation >= OPERATION_COUNT ||
+			!(baseline > 0) || baselineCalls == 0) {
+			cerr << "baseline: malformed line " << lines << " in " << path << ": " << line << endl;
+			return false;
+		}
+		if (run.calls[operation] < MIN_GATED_CALLS || baselineCalls < MIN_GATED_CALLS) {
+			continue;
+		}
+		double current = run.seconds[operation] * 1e9 / run.calls[operation];
+		if (current > baseline * (1 + tolerance)) {
+			cerr << "regression: " << OPERATION_NAMES[operation] << " " << current << "ns/call, baseline "
+				<< baseline << "ns/call" << endl;
+			passed = false;
+		}
+	}
+	if (lines == 0) {
+		cerr << "baseline: " << path << " is empty" << endl;
+		return false;
+	}
+	return passed;
+}
+
+/**
+ * Logs random writes to a tree with a WriteAheadLog, then recovers a second tree from the log and
+ * checks both hold the same pairs. The writes go through every path which reaches the log: inserts,
+ * removes, increments, writes through several references at once, and bulk operations (clear, load,
+ * split and join), with a checkpoint halfway.
+ * @param seed the seed of the random writes
+ * @return returns true if the recovered tree equals the original, returns false and prints why otherwise.
+ */
+bool checkRecovery(uint64_t seed) {
+	string path = (filesystem::temp_directory_path() / ("AVLTreeStress-" + to_string(seed) + ".log")).string();
+	filesystem::remove(path);
+	filesystem::remove(path + ".snapshot");
+	mt19937_64 rng(seed);
+	AVLTree tree;
+	WriteAheadLog log(path);
+	if (!log.open(tree)) {
+		cerr << "recovery: cannot open " << path << endl;
+		return false;
+	}
+	auto write = [&tree, &rng](size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			string key = to_string(rng() % 2000);
+			switch (rng() % 5) {
+			case 0:
+				tree.insert(key, rng() % 1000);
+				break;
+			case 1:
+				tree.remove(key);
+				break;
+			case 2:
+				tree.increment(key, rng() % 10);
+				break;
+			case 3: {
+				// the older reference is written after the newer one
+				AVLTree::ValueReference older = tree[key];
+				AVLTree::ValueReference newer = tree[key + "/"];
+				newer += 1;
+				older = rng() % 1000;
+				break;
+			}
+			case 4: {
+				AVLTree upper;
+				tree.split(key, upper);
+				upper.increment(key, 1);
+				tree.join(upper);
+				break;
+			}
+			}
+		}
+	};
+	write(20000);
+	if (!log.checkpoint()) {
+		cerr << "recovery: checkpoint failed" << endl;
+		return false;
+	}
+	write(20000);
+	vector<pair<string, size_t>> entries = tree.entries();
+	tree.clear();
+	write(2000);
+	tree.clear();
+	tree.load(entries);
+	write(20000);
+	log.close();
+
+	AVLTree recovered;
+	WriteAheadLog replay(path);
+	bool agreed = replay.open(recovered) && recovered.validate() && recovered.entries() == tree.entries();
+	replay.close();
+	filesystem::remove(path);
+	filesystem::remove(path + ".snapshot");
+	if (!agreed) {
+		cerr << "recovery: recovered tree differs, size " << recovered.size() << " expected " << tree.size() << endl;
+		return false;
+	}
+	cout << "recovery (seed " << seed << ") passed" << endl;
+	return true;
+}
+
+/**
+ * Applies random inserts, removes and lookups to a BlockAVLTree and a std::map, checking every result,
+ * range scans, and the block invariants with validate() along the way. Keys range from short to far
+ * longer than a small string, so the blocks' key buffers grow, shrink and move through splits and merges.
+ * @param seed the seed of the random operations
+ * @param operations the number of operations
+ * @return returns true if the tree agreed with the map throughout, returns false and prints why otherwise.
+ */
+bool checkBlockTree(uint64_t seed, size_t operations) {
+	mt19937_64 rng(seed);
+	BlockAVLTree tree;
+	map<string, size_t> reference;
+	for (size_t i = 0; i < operations; i++) {
+		// phases of mostly inserts and mostly removes, so blocks fill and split, then empty and merge
+		bool growing = i / 20000 % 2 == 0;
+		size_t kind = rng() % 6;
+		// every fourth key padded, most past a small string
+		size_t number = rng() % 3000;
+		string key = to_string(number);
+		key.append(number % 4 == 0 ? number % 48 : 0, '.');
+		size_t value = rng() % 1000;
+		bool agreed = true;
+		switch (kind) {
+		case 0:
+		case 1:
+		case 2:
+		case 3:
+			if (growing == (kind < 3)) {
+				agreed = tree.insert(key, value) == reference.emplace(key, value).second;
+			} else {
+				agreed = tree.remove(key) == (reference.erase(key) == 1);
+			}
+			break;
+		case 4: {
+			auto found = reference.find(key);
+			agreed = tree.get(key) == (found == reference.end() ? nullopt : std::optional<size_t>(found->second)) &&
+				tree.contains(key) == (found != reference.end());
+			break;
+		}
+		case 5: {
+			string highKey = key + "~";
+			vector<pair<string, size_t>> expected(reference.lower_bound(key), reference.lower_bound(highKey));
+			agreed = tree.scanRange(key, highKey) == expected;
+			break;
+		}
+		}
+		if (!agreed) {
+			cerr << "block tree: mismatch at operation " << i << " on " << key << " with seed " << seed << endl;
+			return false;
+		}
+		if (i % 5000 == 4999 && (!tree.validate() || tree.size() != reference.size())) {
+			cerr << "block tree: invalid at operation " << i << " with seed " << seed << endl;
+			return false;
+		}
+	}
+	if (!tree.validate() || tree.entries() != vector<pair<string, size_t>>(reference.begin(), reference.end())) {
+		cerr << "block tree: entries differ with seed " << seed << endl;
+		return false;
+	}
+	cout << "block tree (" << operations << " operations, seed " << seed << ") passed" << endl;
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	size_t operations = 1000000;
+	uint64_t seed = 1;
+	string baselinePath;
+	double tolerance = 0.25;
+	bool writing = argc > 1 && string(argv[1]) == "--write-baseline";
+	if (writing) {
+		argc--;
+		argv++;
+	}
+	if (argc > 1) {
+		operations = strtoull(argv[1], nullptr, 10);
+	}
+	if (argc > 2) {
+		seed = strtoull(argv[2], nullptr, 10);
+	}
+	if (argc > 3) {
+		baselinePath = argv[3];
+	}
+	if (argc > 4) {
+		tolerance = strtod(argv[4], nullptr);
+	}
+
+	// mostly point operations, with the whole tree operations rare since they cost O(n)
+	const size_t weights[OPERATION_COUNT] = {
+		3000, 2500, 1500, 1000, 800, 800, 400, 800, 400, 200, 200, 200, 5, 2, 2, 2, 2, 4, 400, 2, 2, 200
+	};
+	if (!checkRecovery(seed) || !checkBlockTree(seed, operations / 4)) {
+		return 1;
+	}
+	discrete_distribution<size_t> pick(begin(weights), end(weights));
+	mt19937_64 rng(seed);
+	StressRun run;
+	char key[16];
+	for (size_t i = 0; i < operations; i++) {
+		// keys drift through the key space so the tree grows, shrinks and moves
+		size_t center = i / 64 % 20000;
+		snprintf(key, sizeof(key), "%06zu", (center + rng() % 4000) % 20000);
+		if (!run.apply(pick(rng), key, rng() % 1000)) {
+			cerr << "failed at operation " << i << " with seed " << seed << endl;
+			return 1;
+		}
+		if (i % 10000 == 9999 && !run.check()) {
+			cerr << "failed at operation " << i << " with seed " << seed << endl;
+			return 1;
+		}
+	}
+	if (!run.check()) {
+		return 1;
+	}
+
+	cout << "stress (" << operations << " operations, seed " << seed << ") passed" << endl;
+	for (size_t i = 0; i < OPERATION_COUNT; i++) {
+		if (run.calls[i] > 0) {
+			cout << "  " << OPERATION_NAMES[i] << ": " << run.calls[i] << " calls, "
+				<< run.seconds[i] * 1e9 / run.calls[i] << "ns/call" << (run.calls[i] < MIN_GATED_CALLS ? " (not gated)" : "") << endl;
+		}
+	}
+	if (!baselinePath.empty() && !(writing ? writeBaseline(run, baselinePath) : checkBaseline(run, baselinePath, tolerance))) {
+		return 1;
+	}
+	return 0;
+}
+#endif
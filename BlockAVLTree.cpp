@@ -0,0 +1,398 @@
+/**
+ * BlockAVLTree.cpp
+ * Sorted leaf blocks of entries indexed by an AVLTree.
+ */
+
+#include "BlockAVLTree.h"
+
+#include <algorithm>
+
+// The default constructor of BlockAVLTree.
+BlockAVLTree::BlockAVLTree() : first(NONE), entryCount(0) {}
+
+/**
+ * Inserts a new key-value pair into the block which covers key, splitting the block in two first if it is full.
+ * @param key the key being inserted
+ * @param value the value being inserted
+ * @return returns true if the insertion is successful, returns false if the key was already in the tree.
+ */
+bool BlockAVLTree::insert(const string& key, size_t value) {
+	if (first == NONE) {
+		first = newBlock();
+		blocks[first].separator = "";
+		index.insert("", first);
+	}
+	size_t block = findBlock(key);
+	size_t position;
+	if (blocks[block].find(key, position)) {
+		return false;
+	}
+	if (blocks[block].count() == BLOCK_ENTRIES) {
+		splitBlock(block);
+		size_t upper = blocks[block].next;
+		if (key >= blocks[upper].separator) {
+			block = upper;
+		}
+		position = blocks[block].lowerBound(key);
+	}
+	blocks[block].insertAt(position, key, value);
+	entryCount++;
+	return true;
+}
+
+/**
+ * Removes a key-value pair. A block left less than a quarter full is merged with a neighbour if the two
+ * fit in three quarters of a block, and an empty block is released.
+ * @param key the key being removed
+ * @return returns true if the key was found and removed, returns false otherwise.
+ */
+bool BlockAVLTree::remove(const string& key) {
+	if (first == NONE) {
+		return false;
+	}
+	size_t block = findBlock(key);
+	Block& target = blocks[block];
+	size_t position;
+	if (!target.find(key, position)) {
+		return false;
+	}
+	target.eraseAt(position);
+	entryCount--;
+
+	// merge small neighbours, then drop an empty block
+	const size_t small = BLOCK_ENTRIES / 4;
+	const size_t merged = BLOCK_ENTRIES * 3 / 4;
+	if (target.count() < small) {
+		if (target.next != NONE && target.count() + blocks[target.next].count() <= merged) {
+			mergeNext(block);
+		} else if (target.prev != NONE && target.count() + blocks[target.prev].count() <= merged) {
+			block = target.prev;
+			mergeNext(block);
+		}
+	}
+	if (blocks[block].count() == 0 && (block != first || blocks[block].next == NONE)) {
+		freeBlock(block);
+	}
+	return true;
+}
+
+/**
+ * @param key the key being checked
+ * @return returns true if the key is in the tree and false otherwise.
+ */
+bool BlockAVLTree::contains(const string& key) const {
+	return get(key).has_value();
+}
+
+/**
+ * Finds the block covering key through the index, then binary searches its keys.
+ * @param key the key associated with the return value
+ * @return returns the value associated with the key, if it is in the tree.
+ */
+std::optional<size_t> BlockAVLTree::get(const string& key) const {
+	if (first == NONE) {
+		return nullopt;
+	}
+	const Block& block = blocks[findBlock(key)];
+	size_t position;
+	if (!block.find(key, position)) {
+		return nullopt;
+	}
+	return block.values[position];
+}
+
+/**
+ * @return returns a vector of all keys in the tree, in key order.
+ */
+vector<string> BlockAVLTree::keys() const {
+	vector<string> keys;
+	keys.reserve(entryCount);
+	for (size_t block = first; block != NONE; block = blocks[block].next) {
+		for (size_t i = 0; i < blocks[block].count(); i++) {
+			keys.emplace_back(blocks[block].key(i));
+		}
+	}
+	return keys;
+}
+
+/**
+ * @return returns a vector of all key-value pairs in the tree, in key order.
+ */
+vector<pair<string, size_t>> BlockAVLTree::entries() const {
+	vector<pair<string, size_t>> entries;
+	entries.reserve(entryCount);
+	for (size_t block = first; block != NONE; block = blocks[block].next) {
+		const Block& current = blocks[block];
+		for (size_t i = 0; i < current.count(); i++) {
+			entries.emplace_back(current.key(i), current.values[i]);
+		}
+	}
+	return entries;
+}
+
+/**
+ * Finds every key-value pair whose key is in [lowKey, highKey), in key order, like AVLTree::scanRange.
+ * Only the first block is searched for, the rest are read in order through the block links.
+ * @param lowKey the first key included
+ * @param highKey the first key not included
+ * @return returns a vector of the key-value pairs in the range.
+ */
+vector<pair<string, size_t>> BlockAVLTree::scanRange(const string& lowKey, const string& highKey) const {
+	vector<pair<string, size_t>> entries;
+	if (first == NONE) {
+		return entries;
+	}
+	size_t block = findBlock(lowKey);
+	const Block* current = &blocks[block];
+	size_t i = current->lowerBound(lowKey);
+	while (true) {
+		for (; i < current->count(); i++) {
+			string_view key = current->key(i);
+			if (key >= highKey) {
+				return entries;
+			}
+			entries.emplace_back(key, current->values[i]);
+		}
+		if (current->next == NONE) {
+			return entries;
+		}
+		current = &blocks[current->next];
+		i = 0;
+	}
+}
+
+/**
+ * @return returns the number of key-value pairs in the tree.
+ */
+size_t BlockAVLTree::size() const {
+	return entryCount;
+}
+
+/**
+ * @return returns the number of leaf blocks in use.
+ */
+size_t BlockAVLTree::getBlockCount() const {
+	return index.size();
+}
+
+/**
+ * Checks the index and every block in O(n): the key table of each block covers its key buffer, the
+ * keys of each block are sorted and within its separator and the next block's, blocks are linked in
+ * key order, every block is indexed under its separator, and the counts add up.
+ * @return returns true if the tree is valid, returns false otherwise.
+ */
+bool BlockAVLTree::validate() const {
+	if (!index.validate()) {
+		return false;
+	}
+	size_t blockCount = 0;
+	size_t entries = 0;
+	size_t prev = NONE;
+	for (size_t block = first; block != NONE; block = blocks[block].next) {
+		const Block& current = blocks[block];
+		if (current.prev != prev || index.get(current.separator) != block) {
+			return false;
+		}
+		size_t count = current.count();
+		if (count != current.values.size() || count > BLOCK_ENTRIES) {
+			return false;
+		}
+		if ((count == 0 ? 0 : current.keyEnds.back()) != current.keyBytes.size() ||
+			!is_sorted(current.keyEnds.begin(), current.keyEnds.end())) {
+			return false;
+		}
+		if ((block == first) != current.separator.empty() || (block != first && count == 0)) {
+			return false;
+		}
+		if (count > 0 && current.key(0) < current.separator) {
+			return false;
+		}
+		for (size_t i = 1; i < count; i++) {
+			if (current.key(i - 1) >= current.key(i)) {
+				return false;
+			}
+		}
+		if (prev != NONE && blocks[prev].count() > 0 && blocks[prev].key(blocks[prev].count() - 1) >= current.separator) {
+			return false;
+		}
+		blockCount++;
+		entries += count;
+		prev = block;
+	}
+	return blockCount == index.size() && entries == entryCount;
+}
+
+/**
+ * finds the block covering key, the block with the largest separator which is not greater than key.
+ * Requires the tree to have a block.
+ * @param key the key being placed
+ * @return returns the index of the block.
+ */
+size_t BlockAVLTree::findBlock(const string& key) const {
+	return index.floorEntry(key).value().second;
+}
+
+/**
+ * takes an unused block, reusing a released one if there is one.
+ * @return returns the index of the new block, which is empty and unlinked.
+ */
+size_t BlockAVLTree::newBlock() {
+	size_t block;
+	if (freeBlocks.empty()) {
+		block = blocks.size();
+		blocks.emplace_back();
+	} else {
+		block = freeBlocks.back();
+		freeBlocks.pop_back();
+	}
+	blocks[block].keyEnds.reserve(BLOCK_ENTRIES);
+	blocks[block].values.reserve(BLOCK_ENTRIES);
+	blocks[block].prev = NONE;
+	blocks[block].next = NONE;
+	return block;
+}
+
+/**
+ * moves the upper half of a full block into a new block linked after it, indexed under its first key.
+ * @param block the block being split
+ */
+void BlockAVLTree::splitBlock(size_t block) {
+	size_t upper = newBlock();
+	Block& lower = blocks[block];
+	Block& moved = blocks[upper];
+	moved.moveFrom(lower, lower.count() / 2);
+	moved.separator = moved.key(0);
+
+	moved.prev = block;
+	moved.next = lower.next;
+	if (lower.next != NONE) {
+		blocks[lower.next].prev = upper;
+	}
+	lower.next = upper;
+	index.insert(moved.separator, upper);
+}
+
+/**
+ * moves every entry of the block after block into block, and releases the emptied block.
+ * @param block the block being merged into, which must have a next block
+ */
+void BlockAVLTree::mergeNext(size_t block) {
+	Block& target = blocks[block];
+	target.moveFrom(blocks[target.next], 0);
+	freeBlock(target.next);
+}
+
+/**
+ * unlinks an empty block, removes it from the index, and keeps it for reuse.
+ * @param block the block being released
+ */
+void BlockAVLTree::freeBlock(size_t block) {
+	Block& released = blocks[block];
+	if (released.prev != NONE) {
+		blocks[released.prev].next = released.next;
+	}
+	if (released.next != NONE) {
+		blocks[released.next].prev = released.prev;
+	}
+	if (block == first) {
+		first = released.next;
+	}
+	index.remove(released.separator);
+	released.separator.clear();
+	freeBlocks.push_back(block);
+}
+
+/**
+ * @return returns the number of entries in the block.
+ */
+size_t BlockAVLTree::Block::count() const {
+	return keyEnds.size();
+}
+
+/**
+ * @param i the position of the key, less than count()
+ * @return returns the key at position i, a view into keyBytes valid until the block changes.
+ */
+string_view BlockAVLTree::Block::key(size_t i) const {
+	size_t start = i == 0 ? 0 : keyEnds[i - 1];
+	return string_view(keyBytes).substr(start, keyEnds[i] - start);
+}
+
+/**
+ * binary searches the keys of the block.
+ * @param key the key being searched for
+ * @return returns the position of the first key not less than key, count() if there is none.
+ */
+size_t BlockAVLTree::Block::lowerBound(string_view key) const {
+	size_t low = 0;
+	size_t high = count();
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (this->key(middle) < key) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+/**
+ * @param key the key being searched for
+ * @param position set to where key is, or to where it would be inserted if it is missing
+ * @return returns true if key is in the block and false otherwise.
+ */
+bool BlockAVLTree::Block::find(string_view key, size_t& position) const {
+	position = lowerBound(key);
+	return position < count() && this->key(position) == key;
+}
+
+/**
+ * inserts an entry, moving the bytes and entries after position up.
+ * @param position where the entry goes, keeping the keys sorted
+ * @param key the key being inserted
+ * @param value the value being inserted
+ */
+void BlockAVLTree::Block::insertAt(size_t position, string_view key, size_t value) {
+	size_t start = position == 0 ? 0 : keyEnds[position - 1];
+	keyBytes.insert(start, key);
+	keyEnds.insert(keyEnds.begin() + position, uint32_t(start));
+	for (size_t i = position; i < keyEnds.size(); i++) {
+		keyEnds[i] += uint32_t(key.size());
+	}
+	values.insert(values.begin() + position, value);
+}
+
+/**
+ * removes an entry, moving the bytes and entries after position down.
+ * @param position the entry being removed
+ */
+void BlockAVLTree::Block::eraseAt(size_t position) {
+	size_t start = position == 0 ? 0 : keyEnds[position - 1];
+	uint32_t length = keyEnds[position] - uint32_t(start);
+	keyBytes.erase(start, length);
+	keyEnds.erase(keyEnds.begin() + position);
+	for (size_t i = position; i < keyEnds.size(); i++) {
+		keyEnds[i] -= length;
+	}
+	values.erase(values.begin() + position);
+}
+
+/**
+ * appends the entries of other from position on, which must all be greater than the keys of this
+ * block, and truncates other to its first position entries.
+ * @param other the block the entries are taken from
+ * @param position the first entry taken
+ */
+void BlockAVLTree::Block::moveFrom(Block& other, size_t position) {
+	size_t start = position == 0 ? 0 : other.keyEnds[position - 1];
+	uint32_t offset = uint32_t(keyBytes.size());
+	keyBytes.append(other.keyBytes, start, string::npos);
+	for (size_t i = position; i < other.count(); i++) {
+		keyEnds.push_back(other.keyEnds[i] - uint32_t(start) + offset);
+	}
+	values.insert(values.end(), other.values.begin() + position, other.values.end());
+	other.keyBytes.resize(start);
+	other.keyEnds.resize(position);
+	other.values.resize(position);
+}
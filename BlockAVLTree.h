@@ -0,0 +1,76 @@
+/**
+ * BlockAVLTree.h
+ *
+ * A map from string keys to size_t values for scan heavy workloads. The entries are kept in sorted
+ * leaf blocks of up to BLOCK_ENTRIES entries, and the blocks are linked in key order. A block stores
+ * its keys inline, back to back in one buffer with a table of where each ends, and its values in an
+ * array, so no key lives in a heap allocation of its own, however long. An AVLTree indexes the blocks by a separator key,
+ * so finding a block costs one O(log(n / BLOCK_ENTRIES)) descent of the index, balanced by the usual
+ * rotations, and the search ends with a binary search inside the block. Scans walk the linked blocks
+ * and read their arrays front to back instead of chasing one pointer per entry.
+ */
+
+#ifndef BLOCKAVLTREE_H
+#define BLOCKAVLTREE_H
+#include "AVLTree.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+class BlockAVLTree {
+public:
+	static constexpr size_t BLOCK_ENTRIES = 64;
+
+	BlockAVLTree();
+
+	bool insert(const string& key, size_t value);
+	bool remove(const string& key);
+	bool contains(const string& key) const;
+	std::optional<size_t> get(const string& key) const;
+	vector<string> keys() const;
+	vector<pair<string, size_t>> entries() const;
+	vector<pair<string, size_t>> scanRange(const string& lowKey, const string& highKey) const;
+	size_t size() const;
+	size_t getBlockCount() const;
+	bool validate() const;
+
+private:
+	static constexpr size_t NONE = SIZE_MAX;
+
+	struct Block {
+		string keyBytes; // the keys, sorted and back to back
+		vector<uint32_t> keyEnds; // key i ends at keyEnds[i] in keyBytes and starts where key i - 1 ends, at most BLOCK_ENTRIES
+		vector<size_t> values; // values[i] belongs to key i
+		string separator; // every key of the block is at least this, and greater than every key of the block before
+		size_t prev;
+		size_t next;
+
+		size_t count() const;
+		string_view key(size_t i) const;
+		size_t lowerBound(string_view key) const;
+		bool find(string_view key, size_t& position) const;
+		void insertAt(size_t position, string_view key, size_t value);
+		void eraseAt(size_t position);
+		void moveFrom(Block& other, size_t position);
+	};
+
+	AVLTree index; // separator -> block, the first block's separator is the empty string
+	vector<Block> blocks;
+	vector<size_t> freeBlocks;
+	size_t first; // the block with the smallest keys, NONE while the tree is empty
+	size_t entryCount;
+
+	size_t findBlock(const string& key) const;
+	size_t newBlock();
+	void splitBlock(size_t block);
+	void mergeNext(size_t block);
+	void freeBlock(size_t block);
+};
+
+#endif //BLOCKAVLTREE_H
@@ -0,0 +1,153 @@
+/**
+ * ChangeStream.cpp
+ * An ordered stream of the changes made to an AVLTree, delivered through a single producer,
+ * multiple consumer ring buffer.
+ */
+
+#include "ChangeStream.h"
+
+#include <algorithm>
+#include <thread>
+
+/**
+ * Creates a stream with no subscribers.
+ * @param capacity the number of events the ring holds, rounded up to a power of two
+ */
+ChangeStream::ChangeStream(size_t capacity) : published(0), slowest(0) {
+	size_t size = 1;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	ring.resize(size);
+	mask = size - 1;
+	for (Cursor& cursor : cursors) {
+		cursor.active.store(false);
+		cursor.position.store(0);
+	}
+}
+
+/**
+ * Adds a subscriber, which reads every event published from now on. Safe to call from any thread.
+ * @return returns the id of the subscriber, or nothing if there are already MAX_SUBSCRIBERS.
+ */
+std::optional<size_t> ChangeStream::subscribe() {
+	lock_guard guard(subscribeLock);
+	for (size_t i = 0; i < cursors.size(); i++) {
+		Cursor& cursor = cursors[i];
+		if (cursor.active.load()) {
+			continue;
+		}
+		cursor.position.store(published.load());
+		cursor.active.store(true);
+		// the producer may have published before it saw the cursor, skip those events
+		cursor.position.store(published.load());
+		return i;
+	}
+	return nullopt;
+}
+
+/**
+ * Removes a subscriber, so the producer no longer waits for it.
+ * @param subscriber the id returned by subscribe
+ */
+void ChangeStream::unsubscribe(size_t subscriber) {
+	if (subscriber < cursors.size()) {
+		cursors[subscriber].active.store(false);
+	}
+}
+
+/**
+ * Reads the events a subscriber has not read yet, without waiting for more. Reading them frees their
+ * space in the ring once every other subscriber has read them too. Each subscriber must be polled
+ * by one thread at a time.
+ * @param subscriber the id returned by subscribe
+ * @param batch the vector the events are appended to, in order
+ * @param maxEvents the most events read
+ * @return returns the number of events read.
+ */
+size_t ChangeStream::poll(size_t subscriber, vector<Event>& batch, size_t maxEvents) {
+	if (subscriber >= cursors.size() || !cursors[subscriber].active.load(memory_order_relaxed)) {
+		return 0;
+	}
+	Cursor& cursor = cursors[subscriber];
+	uint64_t position = cursor.position.load(memory_order_relaxed);
+	uint64_t available = published.load(memory_order_acquire) - position;
+	size_t count = static_cast<size_t>(min<uint64_t>(available, maxEvents));
+	for (size_t i = 0; i < count; i++) {
+		batch.push_back(ring[(position + i) & mask]);
+	}
+	// the producer may reuse the slots once it sees the new position
+	cursor.position.store(position + count, memory_order_release);
+	return count;
+}
+
+/**
+ * @return returns the number of events published so far.
+ */
+uint64_t ChangeStream::getPublished() const {
+	return published.load(memory_order_acquire);
+}
+
+/**
+ * publishes an insert
+ * @param key the key inserted
+ * @param value the value inserted
+ */
+void ChangeStream::onInsert(const AVLTree::KeyType& key, AVLTree::ValueType value) {
+	publish(Change::Insert, key, value);
+}
+
+/**
+ * publishes a value changed by increment, or through operator[] or at
+ * @param key the key changed
+ * @param value the new value
+ */
+void ChangeStream::onUpdate(const AVLTree::KeyType& key, AVLTree::ValueType value) {
+	publish(Change::Update, key, value);
+}
+
+/**
+ * publishes a remove
+ * @param key the key removed
+ */
+void ChangeStream::onRemove(const AVLTree::KeyType& key) {
+	publish(Change::Remove, key, 0);
+}
+
+/**
+ * writes an event into the next slot of the ring and makes it visible to the subscribers. If the slot
+ * still holds an event the slowest subscriber has not read, waits until it has.
+ * @param change the kind of change
+ * @param key the key which changed
+ * @param value the new value of key
+ */
+void ChangeStream::publish(Change change, const AVLTree::KeyType& key, AVLTree::ValueType value) {
+	uint64_t sequence = published.load(memory_order_relaxed);
+	// the cursors are only read again once the ring looks full
+	while (sequence - slowest >= ring.size()) {
+		slowest = findSlowest(sequence);
+		if (sequence - slowest >= ring.size()) {
+			this_thread::yield();
+		}
+	}
+	Event& event = ring[sequence & mask];
+	event.sequence = sequence;
+	event.change = change;
+	event.key = key;
+	event.value = value;
+	published.store(sequence + 1, memory_order_release);
+}
+
+/**
+ * @param sequence the next event being published
+ * @return returns the smallest position of every active subscriber, or sequence if there are none.
+ */
+uint64_t ChangeStream::findSlowest(uint64_t sequence) const {
+	uint64_t smallest = sequence;
+	for (const Cursor& cursor : cursors) {
+		if (cursor.active.load(memory_order_acquire)) {
+			smallest = min(smallest, cursor.position.load(memory_order_acquire));
+		}
+	}
+	return smallest;
+}
@@ -0,0 +1,74 @@
+/**
+ * ChangeStream.h
+ *
+ * Publishes every change made to an AVLTree as an ordered stream of events, so other threads can
+ * follow the tree (for example to keep a read replica up to date) without rescanning it.
+ * The stream listens to the tree and writes insert, update and remove events into a fixed size
+ * ring buffer. The thread changing the tree is the only producer, and every subscriber reads
+ * every event at its own pace through its own cursor, in batches, without taking locks.
+ *
+ * The producer never overwrites an event a subscriber has not read yet: once the ring is full it
+ * waits for the slowest subscriber (backpressure), so every subscriber must keep polling or
+ * unsubscribe. Writes through operator[] and at are published as they happen, see AVLTree::Listener.
+ */
+
+#ifndef CHANGESTREAM_H
+#define CHANGESTREAM_H
+#include "AVLTree.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+using namespace std;
+
+class ChangeStream : public AVLTree::Listener {
+public:
+	enum class Change : uint8_t {
+		Insert,
+		Update,
+		Remove
+	};
+
+	struct Event {
+		uint64_t sequence; // the position of the event in the stream, starting from 0
+		Change change;
+		AVLTree::KeyType key;
+		AVLTree::ValueType value; // 0 for removes
+	};
+
+	static constexpr size_t MAX_SUBSCRIBERS = 16;
+
+	explicit ChangeStream(size_t capacity = 1 << 12);
+
+	std::optional<size_t> subscribe();
+	void unsubscribe(size_t subscriber);
+	size_t poll(size_t subscriber, vector<Event>& batch, size_t maxEvents = SIZE_MAX);
+	uint64_t getPublished() const;
+
+	void onInsert(const AVLTree::KeyType& key, AVLTree::ValueType value) override;
+	void onUpdate(const AVLTree::KeyType& key, AVLTree::ValueType value) override;
+	void onRemove(const AVLTree::KeyType& key) override;
+
+private:
+	// the next event a subscriber reads, on its own cache line
+	struct alignas(64) Cursor {
+		atomic<bool> active;
+		atomic<uint64_t> position;
+	};
+
+	vector<Event> ring; // event i is kept in ring[i & mask]
+	size_t mask;
+	alignas(64) atomic<uint64_t> published; // the number of events published
+	uint64_t slowest; // producer only, a lower bound of every active cursor
+	array<Cursor, MAX_SUBSCRIBERS> cursors;
+	mutex subscribeLock; // held while a cursor is claimed
+
+	void publish(Change change, const AVLTree::KeyType& key, AVLTree::ValueType value);
+	uint64_t findSlowest(uint64_t sequence) const;
+};
+
+#endif //CHANGESTREAM_H
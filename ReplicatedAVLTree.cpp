@@ -0,0 +1,234 @@
+/**
+ * ReplicatedAVLTree.cpp
+ * Per NUMA node read replicas of an AVLTree, kept up to date from the primary's change stream.
+ */
+
+#include "ReplicatedAVLTree.h"
+
+#include <chrono>
+#include <functional>
+
+#ifdef AVLTREE_LIBNUMA
+#include <numa.h>
+#include <sched.h>
+#endif
+
+/**
+ * Creates an empty tree and starts one applier thread per replica.
+ * @param replicaCount the number of replicas, at most ChangeStream::MAX_SUBSCRIBERS, or 0 for one per NUMA node.
+ * Replicas beyond the number of nodes share nodes round robin, which is how several nodes are simulated.
+ */
+ReplicatedAVLTree::ReplicatedAVLTree(size_t replicaCount) : stopping(false) {
+	size_t nodeCount = getNodeCount();
+	if (replicaCount == 0) {
+		replicaCount = nodeCount;
+	}
+	replicaCount = min(replicaCount, ChangeStream::MAX_SUBSCRIBERS);
+	primary.addListener(&log);
+	for (size_t i = 0; i < replicaCount; i++) {
+		unique_ptr<Replica> replica = make_unique<Replica>();
+		replica->applied.store(0);
+		// every replica subscribes before the first write, so each one sees the whole log
+		replica->subscriber = log.subscribe().value();
+		replica->node = static_cast<int>(i % nodeCount);
+		replicas.push_back(std::move(replica));
+	}
+	for (unique_ptr<Replica>& replica : replicas) {
+		replica->applier = thread(&ReplicatedAVLTree::apply, this, ref(*replica));
+	}
+}
+
+// Stops the applier threads, once they have replayed the log.
+ReplicatedAVLTree::~ReplicatedAVLTree() {
+	sync();
+	stopping.store(true, memory_order_release);
+	for (unique_ptr<Replica>& replica : replicas) {
+		replica->applier.join();
+		log.unsubscribe(replica->subscriber);
+	}
+	primary.removeListener(&log);
+}
+
+/**
+ * Inserts a new key-value pair into the primary, and logs it for the replicas.
+ * @param key the key being inserted
+ * @param value the value being inserted
+ * @return returns true if the insertion is successful, returns false if the key was already in the tree.
+ */
+bool ReplicatedAVLTree::insert(const string& key, size_t value) {
+	lock_guard guard(writeLock);
+	return primary.insert(key, value);
+}
+
+/**
+ * Removes a key-value pair from the primary, and logs it for the replicas.
+ * @param key the key being removed
+ * @return returns true if the key was found and removed, returns false otherwise.
+ */
+bool ReplicatedAVLTree::remove(const string& key) {
+	lock_guard guard(writeLock);
+	return primary.remove(key);
+}
+
+/**
+ * Adds delta to the value of key in the primary, inserting key with value 0 first if it is not in the
+ * tree, and logs the new value for the replicas.
+ * @param key the key being counted
+ * @param delta the amount added to the value
+ * @return returns the new value of key.
+ */
+size_t ReplicatedAVLTree::increment(const string& key, size_t delta) {
+	lock_guard guard(writeLock);
+	return primary.increment(key, delta);
+}
+
+/**
+ * @param key the key being checked
+ * @return returns true if the key is in the replica local to the calling thread, false otherwise.
+ */
+bool ReplicatedAVLTree::contains(const string& key) const {
+	return contains(key, getLocalReplica());
+}
+
+/**
+ * @param key the key associated with the return value
+ * @return returns the value associated with the key in the replica local to the calling thread, if it is there.
+ */
+std::optional<size_t> ReplicatedAVLTree::get(const string& key) const {
+	return get(key, getLocalReplica());
+}
+
+/**
+ * @param key the key being checked
+ * @param replica the index of the replica read, taken modulo getReplicaCount
+ * @return returns true if the key is in the replica, false otherwise.
+ */
+bool ReplicatedAVLTree::contains(const string& key, size_t replica) const {
+	const Replica& local = *replicas[replica % replicas.size()];
+	shared_lock lock(local.lock);
+	return local.tree.contains(key);
+}
+
+/**
+ * @param key the key associated with the return value
+ * @param replica the index of the replica read, taken modulo getReplicaCount
+ * @return returns the value associated with the key in the replica, if it is there.
+ */
+std::optional<size_t> ReplicatedAVLTree::get(const string& key, size_t replica) const {
+	const Replica& local = *replicas[replica % replicas.size()];
+	shared_lock lock(local.lock);
+	return local.tree.get(key);
+}
+
+/**
+ * @return returns the number of key-value pairs in the replica local to the calling thread.
+ */
+size_t ReplicatedAVLTree::size() const {
+	const Replica& local = *replicas[getLocalReplica()];
+	shared_lock lock(local.lock);
+	return local.tree.size();
+}
+
+/**
+ * Waits until every replica has applied every write made before the call, so the next lookup on any
+ * replica sees them.
+ */
+void ReplicatedAVLTree::sync() const {
+	uint64_t published = log.getPublished();
+	for (const unique_ptr<Replica>& replica : replicas) {
+		while (replica->applied.load(memory_order_acquire) < published) {
+			this_thread::yield();
+		}
+	}
+}
+
+/**
+ * @return returns the number of replicas.
+ */
+size_t ReplicatedAVLTree::getReplicaCount() const {
+	return replicas.size();
+}
+
+/**
+ * Finds the replica lookups from the calling thread use. With libnuma it is the replica of the NUMA
+ * node the thread runs on, otherwise threads are spread over the replicas by thread id.
+ * @return returns the index of the replica.
+ */
+size_t ReplicatedAVLTree::getLocalReplica() const {
+#ifdef AVLTREE_LIBNUMA
+	int cpu = sched_getcpu();
+	int node = cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+	if (node >= 0) {
+		return static_cast<size_t>(node) % replicas.size();
+	}
+#endif
+	return hash<thread::id>{}(this_thread::get_id()) % replicas.size();
+}
+
+/**
+ * @param replica the index of the replica, taken modulo getReplicaCount
+ * @return returns the number of events of the log the replica has applied.
+ */
+uint64_t ReplicatedAVLTree::getApplied(size_t replica) const {
+	return replicas[replica % replicas.size()]->applied.load(memory_order_acquire);
+}
+
+/**
+ * @return returns the number of NUMA nodes of the machine, or 1 if it is not known.
+ */
+size_t ReplicatedAVLTree::getNodeCount() {
+#ifdef AVLTREE_LIBNUMA
+	if (numa_available() >= 0) {
+		return static_cast<size_t>(max(numa_num_configured_nodes(), 1));
+	}
+#endif
+	return 1;
+}
+
+/**
+ * the loop of a replica's applier thread: polls the log and replays each batch of events into the
+ * replica's tree under its lock, until the tree is destroyed. With libnuma the thread first moves to
+ * the replica's node, so every node and key it allocates is node local.
+ * @param replica the replica being kept up to date
+ */
+void ReplicatedAVLTree::apply(Replica& replica) {
+#ifdef AVLTREE_LIBNUMA
+	if (numa_available() >= 0) {
+		numa_run_on_node(replica.node);
+		numa_set_localalloc();
+	}
+#endif
+	vector<ChangeStream::Event> batch;
+	batch.reserve(APPLY_BATCH);
+	size_t idle = 0;
+	while (!stopping.load(memory_order_acquire)) {
+		batch.clear();
+		if (log.poll(replica.subscriber, batch, APPLY_BATCH) == 0) {
+			// back off while no one writes
+			if (++idle < SPIN_POLLS) {
+				this_thread::yield();
+			} else {
+				this_thread::sleep_for(chrono::microseconds(50));
+			}
+			continue;
+		}
+		idle = 0;
+		{
+			unique_lock lock(replica.lock);
+			for (const ChangeStream::Event& event : batch) {
+				switch (event.change) {
+				case ChangeStream::Change::Insert:
+					replica.tree.insert(event.key, event.value);
+					break;
+				case ChangeStream::Change::Update:
+					replica.tree[event.key] = event.value;
+					break;
+				case ChangeStream::Change::Remove:
+					replica.tree.remove(event.key);
+					break;
+				}
+			}
+		}
+		replica.applied.store(batch.back().sequence + 1, memory_order_release);
+	}
+}
@@ -0,0 +1,82 @@
+/**
+ * ReplicatedAVLTree.h
+ *
+ * A map from string keys to size_t values with one read-only copy (replica) of the tree per NUMA
+ * node, so that lookups only touch memory local to the socket they run on. Writes go to a primary
+ * AVLTree, which publishes every change to a shared operation log (a ChangeStream). Each replica is
+ * kept up to date by its own applier thread, which replays the log into the replica's AVLTree.
+ *
+ * Built with AVLTREE_LIBNUMA, each applier thread runs on its replica's node and allocates from
+ * node local memory, and readers use the replica of the node they run on. Without it, the applier
+ * threads are not placed and the nodes of a replica are simply first touched by its applier, and
+ * readers are spread over the replicas by thread, which simulates several nodes on any machine.
+ *
+ * Replicas trail the primary: a lookup sees the writes its replica has applied so far. Call sync
+ * to wait until every replica has applied every write made before the call.
+ */
+
+#ifndef REPLICATEDAVLTREE_H
+#define REPLICATEDAVLTREE_H
+#include "AVLTree.h"
+#include "ChangeStream.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class ReplicatedAVLTree {
+public:
+	explicit ReplicatedAVLTree(size_t replicaCount = 0);
+	~ReplicatedAVLTree();
+	ReplicatedAVLTree(const ReplicatedAVLTree&) = delete;
+	ReplicatedAVLTree& operator=(const ReplicatedAVLTree&) = delete;
+
+	bool insert(const string& key, size_t value);
+	bool remove(const string& key);
+	size_t increment(const string& key, size_t delta);
+
+	bool contains(const string& key) const;
+	std::optional<size_t> get(const string& key) const;
+	bool contains(const string& key, size_t replica) const;
+	std::optional<size_t> get(const string& key, size_t replica) const;
+	size_t size() const;
+
+	void sync() const;
+	size_t getReplicaCount() const;
+	size_t getLocalReplica() const;
+	uint64_t getApplied(size_t replica) const;
+	static size_t getNodeCount();
+
+private:
+	// the most events an applier replays under one hold of its replica's lock
+	static constexpr size_t APPLY_BATCH = 256;
+	// the empty polls an applier yields for before it starts sleeping between polls
+	static constexpr size_t SPIN_POLLS = 64;
+
+	struct Replica {
+		AVLTree tree;
+		mutable shared_mutex lock; // held shared by lookups, and exclusively while a batch is applied
+		atomic<uint64_t> applied; // the number of events of the log applied to tree
+		size_t subscriber;
+		int node;
+		thread applier;
+	};
+
+	AVLTree primary;
+	mutex writeLock; // serializes writers, the log has a single producer
+	ChangeStream log;
+	vector<unique_ptr<Replica>> replicas;
+	atomic<bool> stopping;
+
+	void apply(Replica& replica);
+};
+
+#endif //REPLICATEDAVLTREE_H
@@ -0,0 +1,306 @@
+/**
+ * ShardedAVLTree.cpp
+ * A key space partitioned over several independently locked AVLTrees.
+ */
+
+#include "ShardedAVLTree.h"
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+
+/**
+ * Creates a hash partitioned tree.
+ * @param shardCount the number of shards, at least 1
+ */
+ShardedAVLTree::ShardedAVLTree(size_t shardCount) : rangePartitioned(false) {
+	if (shardCount == 0) {
+		shardCount = 1;
+	}
+	for (size_t i = 0; i < shardCount; i++) {
+		shards.push_back(make_unique<Shard>());
+	}
+}
+
+/**
+ * Creates a range partitioned tree with one more shard than there are boundaries.
+ * @param boundaries the first key of every shard but the first, in any order
+ */
+ShardedAVLTree::ShardedAVLTree(const vector<string>& boundaries) : rangePartitioned(true), boundaries(boundaries) {
+	sort(this->boundaries.begin(), this->boundaries.end());
+	this->boundaries.erase(unique(this->boundaries.begin(), this->boundaries.end()), this->boundaries.end());
+	for (size_t i = 0; i <= this->boundaries.size(); i++) {
+		shards.push_back(make_unique<Shard>());
+	}
+}
+
+/**
+ * Inserts a new key-value pair into the shard which owns key.
+ * @param key the key being inserted
+ * @param value the value being inserted
+ * @return returns true if the insertion is successful, returns false otherwise.
+ */
+bool ShardedAVLTree::insert(const string& key, size_t value) {
+	shared_lock layout(layoutLock);
+	Shard& shard = *shards[getShardIndex(key)];
+	unique_lock lock(shard.lock);
+	return shard.tree.insert(key, value);
+}
+
+/**
+ * Removes a key-value pair from the shard which owns key.
+ * @param key the key being removed
+ * @return returns true if the key was found and removed, returns false otherwise.
+ */
+bool ShardedAVLTree::remove(const string& key) {
+	shared_lock layout(layoutLock);
+	Shard& shard = *shards[getShardIndex(key)];
+	unique_lock lock(shard.lock);
+	return shard.tree.remove(key);
+}
+
+/**
+ * @param key the key being checked
+ * @return returns true if the key is in the tree and false otherwise.
+ */
+bool ShardedAVLTree::contains(const string& key) const {
+	shared_lock layout(layoutLock);
+	const Shard& shard = *shards[getShardIndex(key)];
+	shared_lock lock(shard.lock);
+	return shard.tree.contains(key);
+}
+
+/**
+ * @param key the key associated with the return value.
+ * @return returns the value associated with the key, if it is in the tree.
+ */
+std::optional<size_t> ShardedAVLTree::get(const string& key) const {
+	shared_lock layout(layoutLock);
+	const Shard& shard = *shards[getShardIndex(key)];
+	shared_lock lock(shard.lock);
+	return shard.tree.get(key);
+}
+
+/**
+ * Finds every value between the values of lowKey and highKey, in key order, like AVLTree::findRange.
+ * Every shard filters its own values concurrently, visiting its entries without copying them.
+ * Range partitioned shards are already in key order, so their values are concatenated. Hash
+ * partitioned shards interleave, so each keeps the keys of the values it matched, and only those
+ * are k-way merged.
+ * @param lowKey the key associated with a lower value
+ * @param highKey the key associated with a higher value
+ * @return returns a vector of all values between that of lowKey and highKey.
+ */
+vector<size_t> ShardedAVLTree::findRange(const string& lowKey, const string& highKey) const {
+	vector<size_t> range;
+	std::optional<size_t> lowVal = get(lowKey);
+	std::optional<size_t> highVal = get(highKey);
+	if (!lowVal.has_value() || !highVal.has_value()) {
+		return range;
+	}
+	size_t low = lowVal.value();
+	size_t high = highVal.value();
+	shared_lock layout(layoutLock);
+	if (rangePartitioned) {
+		vector<future<vector<size_t>>> scans;
+		for (const unique_ptr<Shard>& shard : shards) {
+			const Shard* current = shard.get();
+			scans.push_back(async(launch::async, [current, low, high]() {
+				shared_lock lock(current->lock);
+				vector<size_t> values;
+				current->tree.forEach([&values, low, high](const AVLTree::KeyType&, size_t value) {
+					if (value >= low && value <= high) {
+						values.push_back(value);
+					}
+				});
+				return values;
+			}));
+		}
+		for (future<vector<size_t>>& scan : scans) {
+			vector<size_t> values = scan.get();
+			range.insert(range.end(), values.begin(), values.end());
+		}
+		return range;
+	}
+
+	vector<future<vector<pair<string, size_t>>>> scans;
+	for (const unique_ptr<Shard>& shard : shards) {
+		const Shard* current = shard.get();
+		scans.push_back(async(launch::async, [current, low, high]() {
+			shared_lock lock(current->lock);
+			vector<pair<string, size_t>> matches;
+			current->tree.forEach([&matches, low, high](const AVLTree::KeyType& key, size_t value) {
+				if (value >= low && value <= high) {
+					matches.emplace_back(key, value);
+				}
+			});
+			return matches;
+		}));
+	}
+	vector<vector<pair<string, size_t>>> results;
+	for (future<vector<pair<string, size_t>>>& scan : scans) {
+		results.push_back(scan.get());
+	}
+	for (const pair<string, size_t>& entry : mergeByKey(results)) {
+		range.push_back(entry.second);
+	}
+	return range;
+}
+
+/**
+ * Lists every key in the tree in key order. The shards are scanned concurrently.
+ * @return returns a vector of all keys in the tree.
+ */
+vector<string> ShardedAVLTree::keys() const {
+	vector<string> keys;
+	for (vector<pair<string, size_t>>& shardEntries : collectEntries()) {
+		for (pair<string, size_t>& entry : shardEntries) {
+			keys.push_back(std::move(entry.first));
+		}
+	}
+	return keys;
+}
+
+/**
+ * @return returns the number of key-value pairs in every shard.
+ */
+size_t ShardedAVLTree::size() const {
+	shared_lock layout(layoutLock);
+	size_t total = 0;
+	for (const unique_ptr<Shard>& shard : shards) {
+		shared_lock lock(shard->lock);
+		total += shard->tree.size();
+	}
+	return total;
+}
+
+/**
+ * @return returns the number of shards.
+ */
+size_t ShardedAVLTree::getShardCount() const {
+	shared_lock layout(layoutLock);
+	return shards.size();
+}
+
+/**
+ * @return returns true if keys are assigned to shards by range, false if by hash.
+ */
+bool ShardedAVLTree::isRangePartitioned() const {
+	return rangePartitioned;
+}
+
+/**
+ * Splits a range partitioned shard at its median key into two shards.
+ * @param shard the index of the shard being split
+ * @return returns true if the shard was split, returns false, leaving the shards as they were, if the
+ * tree is hash partitioned, the index is out of range, the shard has fewer than two keys, or its
+ * tree refused the split (see AVLTree::split).
+ */
+bool ShardedAVLTree::splitShard(size_t shard) {
+	unique_lock layout(layoutLock);
+	if (!rangePartitioned || shard >= shards.size() || shards[shard]->tree.size() < 2) {
+		return false;
+	}
+	AVLTree& tree = shards[shard]->tree;
+	string median = tree.keyAt(tree.size() / 2).value();
+
+	unique_ptr<Shard> upper = make_unique<Shard>();
+	if (!tree.split(median, upper->tree)) {
+		return false;
+	}
+	shards.insert(shards.begin() + shard + 1, std::move(upper));
+	boundaries.insert(boundaries.begin() + shard, median);
+	return true;
+}
+
+/**
+ * Merges a range partitioned shard with the shard after it.
+ * @param shard the index of the first shard being merged
+ * @return returns true if the shards were merged, returns false, leaving the shards as they were, if
+ * the tree is hash partitioned, there is no shard after shard, or the first shard's tree refused the
+ * join (see AVLTree::join).
+ */
+bool ShardedAVLTree::mergeShards(size_t shard) {
+	unique_lock layout(layoutLock);
+	if (!rangePartitioned || shard + 1 >= shards.size()) {
+		return false;
+	}
+	if (!shards[shard]->tree.join(shards[shard + 1]->tree)) {
+		return false;
+	}
+	shards.erase(shards.begin() + shard + 1);
+	boundaries.erase(boundaries.begin() + shard);
+	return true;
+}
+
+/**
+ * finds the shard which owns key. Requires layoutLock to be held.
+ * @param key the key being placed
+ * @return returns the index of the shard.
+ */
+size_t ShardedAVLTree::getShardIndex(const string& key) const {
+	if (rangePartitioned) {
+		return upper_bound(boundaries.begin(), boundaries.end(), key) - boundaries.begin();
+	}
+	return hash<string>{}(key) % shards.size();
+}
+
+/**
+ * Reads the entries of every shard concurrently, one task per shard, each holding only its own
+ * shard's lock. Range partitioned shards are already ordered by shard. Hash partitioned shards
+ * are k-way merged so the result is in key order either way.
+ * @return returns the entries as one or more vectors which are in key order when concatenated.
+ */
+vector<vector<pair<string, size_t>>> ShardedAVLTree::collectEntries() const {
+	shared_lock layout(layoutLock);
+	vector<future<vector<pair<string, size_t>>>> scans;
+	for (const unique_ptr<Shard>& shard : shards) {
+		const Shard* current = shard.get();
+		scans.push_back(async(launch::async, [current]() {
+			shared_lock lock(current->lock);
+			return current->tree.entries();
+		}));
+	}
+	vector<vector<pair<string, size_t>>> results;
+	for (future<vector<pair<string, size_t>>>& scan : scans) {
+		results.push_back(scan.get());
+	}
+	if (rangePartitioned) {
+		return results;
+	}
+	return {mergeByKey(results)};
+}
+
+/**
+ * k-way merges the entries of hash partitioned shards into key order.
+ * @param results the entries of every shard, each in key order. They are moved out.
+ * @return returns every entry, in key order.
+ */
+vector<pair<string, size_t>> ShardedAVLTree::mergeByKey(vector<vector<pair<string, size_t>>>& results) {
+	// the heap holds the next unmerged entry of every shard
+	using Cursor = pair<size_t, size_t>; // shard, position
+	auto after = [&results](const Cursor& a, const Cursor& b) {
+		return results[a.first][a.second].first > results[b.first][b.second].first;
+	};
+	priority_queue<Cursor, vector<Cursor>, decltype(after)> heap(after);
+	size_t total = 0;
+	for (size_t i = 0; i < results.size(); i++) {
+		total += results[i].size();
+		if (!results[i].empty()) {
+			heap.push({i, 0});
+		}
+	}
+	vector<pair<string, size_t>> merged;
+	merged.reserve(total);
+	while (!heap.empty()) {
+		Cursor cursor = heap.top();
+		heap.pop();
+		merged.push_back(std::move(results[cursor.first][cursor.second]));
+		if (cursor.second + 1 < results[cursor.first].size()) {
+			heap.push({cursor.first, cursor.second + 1});
+		}
+	}
+	return merged;
+}
@@ -0,0 +1,58 @@
+/**
+ * ShardedAVLTree.h
+ *
+ * A map from string keys to size_t values spread over several AVLTrees (shards), each with its
+ * own lock, so that operations on different shards run in parallel. Keys are assigned to shards
+ * either by hash, or by range using a sorted list of boundary keys. Range partitioned shards can be
+ * split and merged online using AVLTree::split and AVLTree::join.
+ */
+
+#ifndef SHARDEDAVLTREE_H
+#define SHARDEDAVLTREE_H
+#include "AVLTree.h"
+
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class ShardedAVLTree {
+public:
+	explicit ShardedAVLTree(size_t shardCount);
+	explicit ShardedAVLTree(const vector<string>& boundaries);
+
+	bool insert(const string& key, size_t value);
+	bool remove(const string& key);
+	bool contains(const string& key) const;
+	std::optional<size_t> get(const string& key) const;
+	vector<size_t> findRange(const string& lowKey, const string& highKey) const;
+	vector<string> keys() const;
+	size_t size() const;
+
+	size_t getShardCount() const;
+	bool isRangePartitioned() const;
+	bool splitShard(size_t shard);
+	bool mergeShards(size_t shard);
+
+private:
+	struct Shard {
+		AVLTree tree;
+		mutable shared_mutex lock;
+	};
+
+	bool rangePartitioned;
+	vector<unique_ptr<Shard>> shards;
+	// range partitioning only: shard i holds the keys in [boundaries[i - 1], boundaries[i])
+	vector<string> boundaries;
+	// held shared by every operation, and exclusively while shards are split or merged
+	mutable shared_mutex layoutLock;
+
+	size_t getShardIndex(const string& key) const;
+	vector<vector<pair<string, size_t>>> collectEntries() const;
+	static vector<pair<string, size_t>> mergeByKey(vector<vector<pair<string, size_t>>>& results);
+};
+
+#endif //SHARDEDAVLTREE_H
@@ -0,0 +1,536 @@
+/**
+ * WriteAheadLog.cpp
+ * A group committed write-ahead log with snapshot checkpoints for AVLTree.
+ *
+ * Log file:      "AVLW" generation(8) frame*
+ * Frame:         length(4) crc32(4) record*
+ * Record:        operation(1) varint keyLength, key bytes, varint value (not for REMOVE)
+ * Snapshot file: "AVLS" generation(8) count(8) entry* crc32(4)
+ * Entry:         varint keyLength, key bytes, varint value
+ *
+ * Fixed width numbers are little endian. A log is only replayed over the snapshot with the same
+ * generation, so a crash during a checkpoint never replays a log twice. Replay stops at the
+ * first torn frame (short, or failing its checksum), which is where the next frame is written.
+ * A frame which passes its checksum but does not decode is corruption, and fails recovery.
+ * Bulk changes to the tree reach the log as one record per entry, see AVLTree::Listener.
+ */
+
+#include "WriteAheadLog.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+static const char LOG_MAGIC[] = "AVLW";
+static const char SNAPSHOT_MAGIC[] = "AVLS";
+static const size_t HEADER_BYTES = 12;
+
+/**
+ * Creates a closed log.
+ * @param path the file the log is kept in
+ * @param commitInterval the longest time a record waits before it is written and synced
+ */
+WriteAheadLog::WriteAheadLog(const string& path, chrono::milliseconds commitInterval)
+	: path(path), snapshotPath(path + ".snapshot"), commitInterval(commitInterval), tree(nullptr),
+	  logFile(nullptr), generation(0), appended(0), durable(0), syncRequested(false), stopping(false),
+	  writeFailed(false) {}
+
+/**
+ * Closes the log, writing every record first.
+ */
+WriteAheadLog::~WriteAheadLog() {
+	close();
+}
+
+/**
+ * Recovers tree from the last checkpoint and the log written after it, then starts logging
+ * every change made to tree.
+ * @param tree the tree being recovered and logged, must be empty
+ * @return returns true if the log was opened, returns false if it was already open, tree was not empty,
+ * the snapshot or the log was corrupt, or a file could not be written. tree is left empty on failure.
+ */
+bool WriteAheadLog::open(AVLTree& tree) {
+	if (this->tree != nullptr || tree.size() != 0) {
+		return false;
+	}
+	uint64_t validLength = 0;
+	if (!readSnapshot(tree) || !replayLog(tree, validLength)) {
+		tree.clear();
+		return false;
+	}
+
+	// continue the log after its last good frame, or start a new one
+	bool started;
+	if (validLength == 0) {
+		started = startLog(generation);
+	} else {
+		error_code error;
+		filesystem::resize_file(path, validLength, error);
+		logFile = error ? nullptr : fopen(path.c_str(), "ab");
+		started = logFile != nullptr;
+	}
+	if (!started) {
+		tree.clear();
+		return false;
+	}
+
+	this->tree = &tree;
+	appended = 0;
+	durable = 0;
+	syncRequested = false;
+	stopping = false;
+	writeFailed = false;
+	tree.addListener(this);
+	flusher = thread(&WriteAheadLog::runFlusher, this);
+	return true;
+}
+
+/**
+ * Stops logging, writing and syncing every record first. Does nothing if the log is not open.
+ */
+void WriteAheadLog::close() {
+	if (tree == nullptr) {
+		return;
+	}
+	tree->removeListener(this);
+	tree = nullptr;
+	{
+		lock_guard guard(lock);
+		stopping = true;
+	}
+	flushWanted.notify_one();
+	flusher.join();
+	// a failed checkpoint leaves no log file open
+	if (logFile != nullptr) {
+		fclose(logFile);
+		logFile = nullptr;
+	}
+}
+
+/**
+ * Waits until every change made to the tree so far is written and synced.
+ * @return returns true if every record was written, returns false if the log is closed or a write failed.
+ */
+bool WriteAheadLog::sync() {
+	if (tree == nullptr) {
+		return false;
+	}
+	unique_lock guard(lock);
+	uint64_t target = appended;
+	syncRequested = true;
+	flushWanted.notify_one();
+	flushDone.wait(guard, [this, target]() {
+		return durable >= target;
+	});
+	return !writeFailed;
+}
+
+/**
+ * Saves the whole tree to a new snapshot and starts an empty log after it, so recovery only
+ * replays changes made after this call. The tree must not be changed during the checkpoint.
+ * @return returns true if the checkpoint was made, returns false otherwise.
+ */
+bool WriteAheadLog::checkpoint() {
+	if (!sync()) {
+		return false;
+	}
+	if (!writeSnapshot(generation + 1)) {
+		return false;
+	}
+	lock_guard file(fileLock);
+	fclose(logFile);
+	logFile = nullptr;
+	return startLog(generation + 1);
+}
+
+/**
+ * logs an insert
+ * @param key the key inserted
+ * @param value the value inserted
+ */
+void WriteAheadLog::onInsert(const AVLTree::KeyType& key, AVLTree::ValueType value) {
+	append(INSERT, key, value);
+}
+
+/**
+ * logs a value changed by increment, or through operator[] or at
+ * @param key the key changed
+ * @param value the new value
+ */
+void WriteAheadLog::onUpdate(const AVLTree::KeyType& key, AVLTree::ValueType value) {
+	append(UPDATE, key, value);
+}
+
+/**
+ * logs a remove
+ * @param key the key removed
+ */
+void WriteAheadLog::onRemove(const AVLTree::KeyType& key) {
+	append(REMOVE, key, 0);
+}
+
+/**
+ * Encodes a record into the pending batch. Only takes the lock for as long as the encoding,
+ * the flusher thread does the writing.
+ * @param operation the kind of change
+ * @param key the key changed
+ * @param value the new value, unused for REMOVE
+ */
+void WriteAheadLog::append(Operation operation, const AVLTree::KeyType& key, AVLTree::ValueType value) {
+	lock_guard guard(lock);
+	pending.push_back(static_cast<char>(operation));
+	putVarint(pending, key.size());
+	pending.append(key);
+	if (operation != REMOVE) {
+		putVarint(pending, value);
+	}
+	appended++;
+	if (pending.size() >= BATCH_BYTES) {
+		flushWanted.notify_one();
+	}
+}
+
+/**
+ * Body of the flusher thread. Every commitInterval, or sooner if a sync is waiting or the batch is
+ * full, takes every pending record and writes them as a single synced frame.
+ */
+void WriteAheadLog::runFlusher() {
+	unique_lock guard(lock);
+	while (true) {
+		flushWanted.wait_for(guard, commitInterval, [this]() {
+			return stopping || syncRequested || pending.size() >= BATCH_BYTES;
+		});
+		if (pending.empty()) {
+			syncRequested = false;
+			durable = appended;
+			flushDone.notify_all();
+			if (stopping) {
+				return;
+			}
+			continue;
+		}
+		string batch;
+		batch.swap(pending);
+		uint64_t batchEnd = appended;
+		syncRequested = false;
+
+		// write without the lock so the tree can keep appending
+		guard.unlock();
+		bool written;
+		{
+			lock_guard file(fileLock);
+			written = writeFrame(batch);
+		}
+		guard.lock();
+		if (!written) {
+			writeFailed = true;
+		}
+		durable = batchEnd;
+		flushDone.notify_all();
+	}
+}
+
+/**
+ * Writes one frame to the end of the log and syncs it. Requires fileLock to be held.
+ * @param payload the records in the frame
+ * @return returns true if the frame was written and synced.
+ */
+bool WriteAheadLog::writeFrame(const string& payload) {
+	if (logFile == nullptr) {
+		return false;
+	}
+	string header;
+	putFixed(header, payload.size(), 4);
+	putFixed(header, crc32(0, payload.data(), payload.size()), 4);
+	if (fwrite(header.data(), 1, header.size(), logFile) != header.size()) {
+		return false;
+	}
+	if (fwrite(payload.data(), 1, payload.size(), logFile) != payload.size()) {
+		return false;
+	}
+	return fflush(logFile) == 0 && syncFile(logFile);
+}
+
+/**
+ * Replaces the log with an empty log continuing from a snapshot. Requires fileLock to be
+ * held if the flusher is running.
+ * @param newGeneration the generation of the snapshot the log continues from
+ * @return returns true if the log was started.
+ */
+bool WriteAheadLog::startLog(uint64_t newGeneration) {
+	logFile = fopen(path.c_str(), "wb");
+	if (logFile == nullptr) {
+		return false;
+	}
+	string header(LOG_MAGIC, 4);
+	putFixed(header, newGeneration, 8);
+	if (fwrite(header.data(), 1, header.size(), logFile) != header.size() || fflush(logFile) != 0 || !syncFile(logFile)) {
+		fclose(logFile);
+		logFile = nullptr;
+		return false;
+	}
+	generation = newGeneration;
+	return true;
+}
+
+/**
+ * Bulk loads the snapshot into tree, and sets the generation to the snapshot's.
+ * A missing snapshot is an empty tree at generation 0.
+ * @param tree the tree being loaded
+ * @return returns true if the snapshot was loaded, returns false if it is corrupt.
+ */
+bool WriteAheadLog::readSnapshot(AVLTree& tree) {
+	generation = 0;
+	ifstream file(snapshotPath, ios::binary);
+	if (!file) {
+		return true;
+	}
+	string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	if (data.size() < HEADER_BYTES + 12 || data.compare(0, 4, SNAPSHOT_MAGIC, 4) != 0) {
+		return false;
+	}
+	size_t end = data.size() - 4;
+	if (crc32(0, data.data() + HEADER_BYTES + 8, end - HEADER_BYTES - 8) != getFixed(data, end, 4)) {
+		return false;
+	}
+	uint64_t snapshotGeneration = getFixed(data, 4, 8);
+	uint64_t count = getFixed(data, HEADER_BYTES, 8);
+
+	vector<pair<AVLTree::KeyType, AVLTree::ValueType>> entries;
+	entries.reserve(count);
+	size_t position = HEADER_BYTES + 8;
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t keyLength, value;
+		if (!getVarint(data, position, keyLength) || keyLength > end - position) {
+			return false;
+		}
+		string key = data.substr(position, keyLength);
+		position += keyLength;
+		if (!getVarint(data, position, value)) {
+			return false;
+		}
+		entries.emplace_back(std::move(key), value);
+	}
+	if (!tree.load(entries)) {
+		return false;
+	}
+	generation = snapshotGeneration;
+	return true;
+}
+
+/**
+ * Writes every pair in the tree to a new snapshot, replacing the old one only once the new one
+ * is synced.
+ * @param newGeneration the generation of the new snapshot
+ * @return returns true if the snapshot was written.
+ */
+bool WriteAheadLog::writeSnapshot(uint64_t newGeneration) {
+	string temporaryPath = snapshotPath + ".tmp";
+	FILE* file = fopen(temporaryPath.c_str(), "wb");
+	if (file == nullptr) {
+		return false;
+	}
+	vector<pair<AVLTree::KeyType, AVLTree::ValueType>> entries = tree->entries(0);
+	string buffer(SNAPSHOT_MAGIC, 4);
+	putFixed(buffer, newGeneration, 8);
+	putFixed(buffer, entries.size(), 8);
+	uint32_t crc = 0;
+
+	// write in chunks, the snapshot of a large tree does not fit in one string comfortably
+	bool written = true;
+	size_t crcFrom = HEADER_BYTES + 8;
+	for (size_t i = 0; i <= entries.size() && written; i++) {
+		if (i < entries.size()) {
+			putVarint(buffer, entries[i].first.size());
+			buffer.append(entries[i].first);
+			putVarint(buffer, entries[i].second);
+		}
+		if (buffer.size() >= BATCH_BYTES || i == entries.size()) {
+			crc = crc32(crc, buffer.data() + crcFrom, buffer.size() - crcFrom);
+			if (i == entries.size()) {
+				putFixed(buffer, crc, 4);
+			}
+			written = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+			buffer.clear();
+			crcFrom = 0;
+		}
+	}
+	written = written && fflush(file) == 0 && syncFile(file);
+	fclose(file);
+	if (!written) {
+		return false;
+	}
+	error_code error;
+	filesystem::rename(temporaryPath, snapshotPath, error);
+	return !error;
+}
+
+/**
+ * Applies every record of the log to tree, if the log continues from the loaded snapshot. Each frame
+ * is decoded whole before any of its records is applied.
+ * @param tree the tree the records are applied to
+ * @param validLength set to the length of the log up to its last good frame, 0 if the log
+ * is missing or belongs to another snapshot.
+ * @return returns true if the log was replayed or there was no log to replay, returns false if a frame
+ * passed its checksum but did not decode.
+ */
+bool WriteAheadLog::replayLog(AVLTree& tree, uint64_t& validLength) {
+	validLength = 0;
+	ifstream file(path, ios::binary);
+	if (!file) {
+		return true;
+	}
+	string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	if (data.size() < HEADER_BYTES || data.compare(0, 4, LOG_MAGIC, 4) != 0 || getFixed(data, 4, 8) != generation) {
+		return true;
+	}
+	struct Record {
+		Operation operation;
+		string key;
+		uint64_t value;
+	};
+	vector<Record> records;
+	size_t position = HEADER_BYTES;
+	while (data.size() - position >= 8) {
+		uint64_t length = getFixed(data, position, 4);
+		uint64_t crc = getFixed(data, position + 4, 4);
+		size_t begin = position + 8;
+		if (length > data.size() - begin || crc32(0, data.data() + begin, length) != crc) {
+			break;
+		}
+		// decode only within the frame, every record must end inside it
+		string frame = data.substr(begin, length);
+		size_t record = 0;
+		records.clear();
+		while (record < frame.size()) {
+			auto operation = static_cast<Operation>(frame[record++]);
+			uint64_t keyLength, value = 0;
+			if ((operation != INSERT && operation != UPDATE && operation != REMOVE) ||
+				!getVarint(frame, record, keyLength) || keyLength > frame.size() - record) {
+				return false;
+			}
+			string key = frame.substr(record, keyLength);
+			record += keyLength;
+			if (operation != REMOVE && !getVarint(frame, record, value)) {
+				return false;
+			}
+			records.push_back({operation, std::move(key), value});
+		}
+		for (const Record& change : records) {
+			if (change.operation == REMOVE) {
+				tree.remove(change.key);
+			} else if (!tree.insert(change.key, change.value)) {
+				tree[change.key] = change.value;
+			}
+		}
+		position = begin + length;
+	}
+	validLength = position;
+	return true;
+}
+
+/**
+ * appends value as a LEB128 varint
+ * @param out the string being appended to
+ * @param value the number being encoded
+ */
+void WriteAheadLog::putVarint(string& out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<char>(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+/**
+ * reads a LEB128 varint
+ * @param in the string being read
+ * @param position the position of the varint, moved past it
+ * @param value set to the decoded number
+ * @return returns true if a whole varint was read.
+ */
+bool WriteAheadLog::getVarint(const string& in, size_t& position, uint64_t& value) {
+	value = 0;
+	for (int shift = 0; shift < 64 && position < in.size(); shift += 7) {
+		auto byte = static_cast<uint8_t>(in[position++]);
+		value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * appends the low bytes of value, little endian
+ * @param out the string being appended to
+ * @param value the number being encoded
+ * @param bytes the number of bytes written
+ */
+void WriteAheadLog::putFixed(string& out, uint64_t value, size_t bytes) {
+	for (size_t i = 0; i < bytes; i++) {
+		out.push_back(static_cast<char>(value >> (8 * i)));
+	}
+}
+
+/**
+ * reads a little endian number, the caller checks the bytes exist
+ * @param in the string being read
+ * @param position the position of the number
+ * @param bytes the number of bytes read
+ * @return returns the decoded number.
+ */
+uint64_t WriteAheadLog::getFixed(const string& in, size_t position, size_t bytes) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; i++) {
+		value |= static_cast<uint64_t>(static_cast<uint8_t>(in[position + i])) << (8 * i);
+	}
+	return value;
+}
+
+/**
+ * continues a CRC-32 (IEEE) checksum over more data
+ * @param crc the checksum of the data before, 0 to start
+ * @param data the data being added
+ * @param length the number of bytes being added
+ * @return returns the checksum including data.
+ */
+uint32_t WriteAheadLog::crc32(uint32_t crc, const char* data, size_t length) {
+	static const vector<uint32_t> table = []() {
+		vector<uint32_t> entries(256);
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t entry = i;
+			for (int bit = 0; bit < 8; bit++) {
+				entry = (entry & 1) ? 0xEDB88320u ^ (entry >> 1) : entry >> 1;
+			}
+			entries[i] = entry;
+		}
+		return entries;
+	}();
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++) {
+		crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/**
+ * asks the operating system to put the file's written data on disk
+ * @param file the file being synced
+ * @return returns true if the data is on disk.
+ */
+bool WriteAheadLog::syncFile(FILE* file) {
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
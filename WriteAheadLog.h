@@ -0,0 +1,87 @@
+/**
+ * WriteAheadLog.h
+ *
+ * An append-only log of the changes made to an AVLTree, so the tree survives a crash.
+ * The log listens to the tree, encodes every insert, remove and update (bulk operations included,
+ * one record per entry they add or remove) into a compact binary record in memory, and a background
+ * thread writes and syncs the records in batches (group commit), keeping disk writes off the thread
+ * changing the tree. checkpoint() saves the whole tree to a snapshot and empties the log, and
+ * open() recovers a tree by bulk loading the snapshot and replaying the log written after it.
+ *
+ * Files: <path> holds the log, <path>.snapshot holds the last checkpoint.
+ */
+
+#ifndef WRITEAHEADLOG_H
+#define WRITEAHEADLOG_H
+#include "AVLTree.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+class WriteAheadLog : public AVLTree::Listener {
+public:
+	explicit WriteAheadLog(const string& path, chrono::milliseconds commitInterval = chrono::milliseconds(5));
+	~WriteAheadLog() override;
+
+	bool open(AVLTree& tree);
+	void close();
+	bool sync();
+	bool checkpoint();
+
+	void onInsert(const AVLTree::KeyType& key, AVLTree::ValueType value) override;
+	void onUpdate(const AVLTree::KeyType& key, AVLTree::ValueType value) override;
+	void onRemove(const AVLTree::KeyType& key) override;
+
+private:
+	enum Operation : uint8_t {
+		INSERT = 1,
+		UPDATE = 2,
+		REMOVE = 3
+	};
+
+	string path;
+	string snapshotPath;
+	chrono::milliseconds commitInterval;
+	AVLTree* tree;
+	FILE* logFile;
+	uint64_t generation; // the checkpoint the log continues from
+
+	// records waiting for the flusher, guarded by lock
+	static constexpr size_t BATCH_BYTES = 1 << 20;
+	mutex lock;
+	condition_variable flushWanted;
+	condition_variable flushDone;
+	string pending;
+	uint64_t appended; // records appended since open
+	uint64_t durable; // records written and synced since open
+	bool syncRequested;
+	bool stopping;
+	bool writeFailed;
+	thread flusher;
+	// held while logFile is written or replaced
+	mutex fileLock;
+
+	void append(Operation operation, const AVLTree::KeyType& key, AVLTree::ValueType value);
+	void runFlusher();
+	bool writeFrame(const string& payload);
+	bool startLog(uint64_t newGeneration);
+	bool readSnapshot(AVLTree& tree);
+	bool writeSnapshot(uint64_t newGeneration);
+	bool replayLog(AVLTree& tree, uint64_t& validLength);
+
+	static void putVarint(string& out, uint64_t value);
+	static bool getVarint(const string& in, size_t& position, uint64_t& value);
+	static void putFixed(string& out, uint64_t value, size_t bytes);
+	static uint64_t getFixed(const string& in, size_t position, size_t bytes);
+	static uint32_t crc32(uint32_t crc, const char* data, size_t length);
+	static bool syncFile(FILE* file);
+};
+
+#endif //WRITEAHEADLOG_H